@@ -1,97 +1,178 @@
-#include <array>
+#include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <filesystem>
-#include <fstream>
 #include <iostream>
+#include <memory>
 #include <vector>
 
 #include <pthread.h>
-#include <sys/syscall.h>
 #include <unistd.h>
 
+#include "bmp.h"
+#include "metrics.h"
+
 static const std::filesystem::path INPUT_FILEPATH{ "img01.bmp" };
-static constexpr auto HEADER_SIZE{ 54U };
-static constexpr auto THREADS_NUM{ 5U };
+static constexpr auto CHUNK_SIZE{ 64U << 10 };
+
+class pthread_team;
 
-uint64_t proceed(const std::vector<char>& data);
+uint64_t proceed(const pixel_view& view, size_t threads_num = std::max(1L, sysconf(_SC_NPROCESSORS_ONLN)));
+uint64_t proceed(const pixel_view& view, pthread_team& team);
 void* job(void* arg);
 
 struct task_t
 {
-    const std::vector<char>& data;
+    const pixel_view& view;
     pthread_mutex_t* mutex;
+    std::atomic<size_t>& next_row;
     uint64_t& cnt;
     size_t tid;
 
-    task_t(const std::vector<char>& data, pthread_mutex_t* mutex, uint64_t& cnt, size_t tid)
-        : data(data)
+    task_t(const pixel_view& view, pthread_mutex_t* mutex, std::atomic<size_t>& next_row, uint64_t& cnt, size_t tid)
+        : view(view)
         , mutex(mutex)
+        , next_row(next_row)
         , cnt(cnt)
         , tid(tid)
     {}
 };
 
-int main()
+// pthreads created once and kept for every run(), so a caller that counts
+// many images pays for thread creation only once. Each run() hands one
+// argument to each thread and returns when all of them are done.
+class pthread_team
 {
-    std::ifstream input(INPUT_FILEPATH, std::ios::in | std::ios::binary);
-    if (!input.is_open())
+public:
+    explicit pthread_team(size_t threads_num)
+        : m_threads(threads_num)
     {
-        std::cerr << "Failed to open file: path=" << INPUT_FILEPATH << '\n';
-        return -1;
+        pthread_mutex_init(&m_mutex, NULL);
+        pthread_cond_init(&m_start, NULL);
+        pthread_cond_init(&m_done, NULL);
+        for (auto&& thread : m_threads)
+            pthread_create(&thread, NULL, &member, this);
     }
 
-    std::vector<char> data;
+    pthread_team(const pthread_team&) = delete;
+    pthread_team& operator=(const pthread_team&) = delete;
+
+    ~pthread_team()
     {
-        std::array<char, HEADER_SIZE> header;
-        input.read(header.data(), header.size());
+        pthread_mutex_lock(&m_mutex);
+        m_stop = true;
+        pthread_cond_broadcast(&m_start);
+        pthread_mutex_unlock(&m_mutex);
 
-        const auto data_offset = *reinterpret_cast<uint32_t*>(&header[10]);
-        const auto width = *reinterpret_cast<uint32_t*>(&header[18]);
-        const auto height = *reinterpret_cast<uint32_t*>(&header[22]);
-        std::cout << "data_offset=" << data_offset << ", width=" << width << ", height=" << height << '\n';
+        for (auto&& thread : m_threads)
+            pthread_join(thread, NULL);
 
-        data.resize(data_offset - HEADER_SIZE);
-        input.read(data.data(), data.size());
+        pthread_cond_destroy(&m_done);
+        pthread_cond_destroy(&m_start);
+        pthread_mutex_destroy(&m_mutex);
+    }
 
-        data.reserve(((width * 3 + 3) & (~3)) * height);
+    size_t size() const { return m_threads.size(); }
 
-        std::vector<char> row_padded((width * 3 + 3) & (~3));
-        for (size_t i{}; i < height; ++i)
+    // Runs fn(args[i]) on the i-th thread; `args` holds size() entries.
+    void run(void* (*fn)(void*), const std::vector<void*>& args)
+    {
+        pthread_mutex_lock(&m_mutex);
+        m_fn = fn;
+        m_args = &args;
+        m_next = 0;
+        m_running = m_threads.size();
+        ++m_generation;
+        pthread_cond_broadcast(&m_start);
+        while (m_running)
+            pthread_cond_wait(&m_done, &m_mutex);
+        pthread_mutex_unlock(&m_mutex);
+    }
+
+private:
+    static void* member(void* arg)
+    {
+        auto* team = reinterpret_cast<pthread_team*>(arg);
+        size_t seen{};
+
+        pthread_mutex_lock(&team->m_mutex);
+        for (;;)
         {
-            input.read(row_padded.data(), row_padded.size());
-            for (size_t j{}; j < width * 3; j += 3)
-            {
-                data.push_back(row_padded[j]);
-                data.push_back(row_padded[j + 1]);
-                data.push_back(row_padded[j + 2]);
-            }
+            while (!team->m_stop && team->m_generation == seen)
+                pthread_cond_wait(&team->m_start, &team->m_mutex);
+            if (team->m_stop)
+                break;
+            seen = team->m_generation;
+
+            auto* fn = team->m_fn;
+            auto* task = (*team->m_args)[team->m_next++];
+            pthread_mutex_unlock(&team->m_mutex);
+            fn(task);
+            pthread_mutex_lock(&team->m_mutex);
+
+            if (!--team->m_running)
+                pthread_cond_signal(&team->m_done);
         }
+        pthread_mutex_unlock(&team->m_mutex);
 
-        assert(data.size() % 3 == 0);
+        return nullptr;
     }
 
-    const auto res = proceed(data);
+    std::vector<pthread_t> m_threads;
+    pthread_mutex_t m_mutex;
+    pthread_cond_t m_start;
+    pthread_cond_t m_done;
+    void* (*m_fn)(void*) {};
+    const std::vector<void*>* m_args{};
+    size_t m_next{};
+    size_t m_running{};
+    size_t m_generation{};
+    bool m_stop{};
+};
+
+#ifndef NO_MAIN
+int main()
+{
+    const bmp_image image(INPUT_FILEPATH);
+    if (!image.is_open())
+    {
+        std::cerr << "Failed to open file: path=" << INPUT_FILEPATH << '\n';
+        return -1;
+    }
+
+    const auto& view = image.view();
+    std::cout << "data_offset=" << image.data_offset() << ", width=" << view.width << ", height=" << view.height << '\n';
+
+    const auto res = proceed(view);
     std::cout << "2: cnt=" << res << '\n';
 
     return 0;
 }
+#endif
+
+// A one-off team; callers that count repeatedly keep a pthread_team instead.
+uint64_t proceed(const pixel_view& view, size_t threads_num)
+{
+    pthread_team team(threads_num);
+    return proceed(view, team);
+}
 
-uint64_t proceed(const std::vector<char>& data)
+uint64_t proceed(const pixel_view& view, pthread_team& team)
 {
     pthread_mutex_t mutex;
     pthread_mutex_init(&mutex, NULL);
 
     uint64_t cnt{};
-    std::array<std::shared_ptr<task_t>, THREADS_NUM> tasks;
-    std::vector<pthread_t> workers(THREADS_NUM);
-    for (size_t i{}; i < THREADS_NUM; ++i)
+    std::atomic<size_t> next_row{};
+    std::vector<std::shared_ptr<task_t>> tasks(team.size());
+    std::vector<void*> args(team.size());
+    for (size_t i{}; i < team.size(); ++i)
     {
-        tasks[i] = std::make_shared<task_t>(data, &mutex, cnt, i);
-        pthread_create(&workers[i], NULL, &job, reinterpret_cast<void*>(tasks[i].get()));
+        tasks[i] = std::make_shared<task_t>(view, &mutex, next_row, cnt, i);
+        args[i] = tasks[i].get();
     }
 
-    for (auto&& worker : workers)
-        pthread_join(worker, NULL);
+    team.run(&job, args);
 
     pthread_mutex_destroy(&mutex);
 
@@ -103,18 +184,31 @@ void* job(void* arg)
     const auto* task = reinterpret_cast<task_t*>(arg);
     assert(task);
 
-    const long end = task->data.size() - (task->tid + 1) * task->data.size() / THREADS_NUM - 1;
-    const long start = task->data.size() - task->tid * task->data.size() / THREADS_NUM - 1;
-    assert((start - end) % 3 == 0);
+    // Workers claim chunks of rows until none are left, so a slow core takes
+    // fewer chunks instead of holding back a fixed slice.
+    const auto& view = task->view;
+    const auto chunk_rows = std::max<size_t>(1, CHUNK_SIZE / view.stride);
 
     uint64_t local_cnt{};
-    for (long i = start; i > end; i -= 3)
-        if (static_cast<size_t>(task->data[i]) * task->data[i - 1] * task->data[i - 2] < 1000)
-            ++local_cnt;
+    {
+        phase_span span("compute");
+        for (auto first = task->next_row.fetch_add(chunk_rows); first < view.height; first = task->next_row.fetch_add(chunk_rows))
+        {
+            const auto last = std::min(view.height, first + chunk_rows);
+            for (auto y = first; y < last; ++y)
+            {
+                const auto* data = view.row(y);
+                for (size_t i{}; i < view.row_size(); i += 3)
+                    if (static_cast<size_t>(data[i]) * data[i + 1] * data[i + 2] < 1000)
+                        ++local_cnt;
+            }
+            span.add_bytes((last - first) * view.row_size());
+        }
+    }
 
+    phase_span span("reduce");
     pthread_mutex_lock(task->mutex);
     task->cnt += local_cnt;
-    std::cout << syscall(SYS_gettid) << "(" << task->tid << "): local_cnt=" << local_cnt << '\n';
     pthread_mutex_unlock(task->mutex);
 
     return nullptr;
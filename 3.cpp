@@ -1,86 +1,143 @@
-#include <array>
-#include <cassert>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
 #include <filesystem>
-#include <fstream>
 #include <iostream>
 #include <mutex>
-#include <thread>
+#include <string>
 #include <vector>
 
+#include "bmp.h"
+#include "kernel.h"
+#include "metrics.h"
+#include "placed_image.h"
+#include "thread_pool.h"
+
 static const std::filesystem::path INPUT_FILEPATH{ "img03.bmp" };
-static constexpr auto HEADER_SIZE{ 54U };
-static constexpr auto THREADS_NUM{ 5U };
+static constexpr auto CHUNK_SIZE{ 64U << 10 };
+static constexpr auto BAND_SIZE{ 1U << 20 };
+
+uint64_t proceed(const pixel_view& view, thread_pool& pool = thread_pool::instance());
+uint64_t proceed_placed(const pixel_view& view, thread_pool& pool = thread_pool::instance());
+uint64_t proceed_stream(bmp_reader& reader, thread_pool& pool = thread_pool::instance());
+
+#ifndef NO_MAIN
+// `./3 stream` reads the image in bands instead of mapping it. `./3 numa`
+// counts a copy placed on the nodes of the pool's workers; run it with
+// BGR_PIN=scatter (or compact) so the workers stay on those nodes.
+int main(int argc, char* argv[])
+{
+    if (argc >= 2 && std::string(argv[1]) == "stream")
+    {
+        bmp_reader reader(INPUT_FILEPATH);
+        if (!reader.is_open())
+        {
+            std::cerr << "Failed to open file: path=" << INPUT_FILEPATH << '\n';
+            return -1;
+        }
 
-uint64_t proceed(const std::vector<char>& data);
+        const auto& info = reader.info();
+        std::cout << "data_offset=" << info.data_offset << ", width=" << info.width << ", height=" << info.height << '\n';
 
-int main()
-{
-    std::ifstream input(INPUT_FILEPATH, std::ios::in | std::ios::binary);
-    if (!input.is_open())
+        const auto res = proceed_stream(reader);
+        std::cout << "3: cnt=" << res << '\n';
+
+        return 0;
+    }
+
+    const bmp_image image(INPUT_FILEPATH);
+    if (!image.is_open())
     {
         std::cerr << "Failed to open file: path=" << INPUT_FILEPATH << '\n';
         return -1;
     }
 
-    std::vector<char> data;
-    {
-        std::array<char, HEADER_SIZE> header;
-        input.read(header.data(), header.size());
+    const auto& view = image.view();
+    std::cout << "data_offset=" << image.data_offset() << ", width=" << view.width << ", height=" << view.height << '\n';
 
-        const auto data_offset = *reinterpret_cast<uint32_t*>(&header[10]);
-        const auto width = *reinterpret_cast<uint32_t*>(&header[18]);
-        const auto height = *reinterpret_cast<uint32_t*>(&header[22]);
-        std::cout << "data_offset=" << data_offset << ", width=" << width << ", height=" << height << '\n';
+    if (argc >= 2 && std::string(argv[1]) == "numa")
+    {
+        const placed_image placed(view, thread_policy{});
+        const auto res = proceed_placed(placed.view());
+        std::cout << "3: cnt=" << res << '\n';
+        return 0;
+    }
 
-        data.resize(data_offset - HEADER_SIZE);
-        input.read(data.data(), data.size());
+    const auto res = proceed(view);
+    std::cout << "3: cnt=" << res << '\n';
 
-        data.reserve(((width * 3 + 3) & (~3)) * height);
+    return 0;
+}
+#endif
 
-        std::vector<char> row_padded((width * 3 + 3) & (~3));
-        for (size_t i{}; i < height; ++i)
-        {
-            input.read(row_padded.data(), row_padded.size());
-            for (size_t j{}; j < width * 3; j += 3)
-            {
-                data.push_back(row_padded[j]);
-                data.push_back(row_padded[j + 1]);
-                data.push_back(row_padded[j + 2]);
-            }
-        }
+// Rows are split into chunks of about CHUNK_SIZE bytes on the shared pool, so
+// every core takes part and a slow one only holds back its current chunk. The
+// pool deals the chunks out in contiguous blocks in worker order, so with
+// pinned workers each node scans its own range of rows.
+uint64_t proceed(const pixel_view& view, thread_pool& pool)
+{
+    std::atomic<uint64_t> cnt{};
+    const auto chunk_rows = std::max<size_t>(1, CHUNK_SIZE / view.stride);
+    pool.parallel_for(0, view.height, chunk_rows, [&view, &cnt](size_t first, size_t last) {
+        phase_span span("compute", (last - first) * view.row_size());
+        cnt.fetch_add(count_product_below(view.rows(first, last - first)), std::memory_order_relaxed);
+        });
 
-        assert(data.size() % 3 == 0);
-    }
+    return cnt;
+}
 
-    const auto res = proceed(data);
-    std::cout << "3: cnt=" << res << '\n';
+// For a placed_image copy: every worker scans the one block of rows it placed,
+// with no stealing, so none of its reads goes to another node.
+uint64_t proceed_placed(const pixel_view& view, thread_pool& pool)
+{
+    std::atomic<uint64_t> cnt{};
+    pool.for_each_worker(0, view.height, [&view, &cnt](size_t, size_t first, size_t last) {
+        phase_span span("compute", (last - first) * view.row_size());
+        cnt.fetch_add(count_product_below(view.rows(first, last - first)), std::memory_order_relaxed);
+        });
 
-    return 0;
+    return cnt;
 }
 
-uint64_t proceed(const std::vector<char>& data)
+// The calling thread reads bands of rows into a fixed set of buffers while the
+// pool counts the bands read so far, so reading overlaps counting and memory
+// stays bounded by a few BAND_SIZE buffers whatever the image size.
+uint64_t proceed_stream(bmp_reader& reader, thread_pool& pool)
 {
+    const auto band_rows = std::max<size_t>(1, BAND_SIZE / reader.info().stride);
+
     std::mutex m;
-    uint64_t cnt{};
-
-    std::vector<std::thread> workers;
-    for (size_t i{}; i < THREADS_NUM; ++i)
-        workers.emplace_back([&data, &m, &cnt, tid = i] {
-        uint64_t local_cnt{};
-        const long end = data.size() - (tid + 1) * data.size() / THREADS_NUM - 1;
-        const long start = data.size() - tid * data.size() / THREADS_NUM - 1;
-        assert((start - end) % 3 == 0);
-        for (long i = start; i > end; i -= 3)
-            if (static_cast<size_t>(data[i]) * data[i - 1] * data[i - 2] < 1000)
-                ++local_cnt;
-
-        std::lock_guard _(m);
-        cnt += local_cnt;
-        std::cout << std::this_thread::get_id() << "(" << tid << "): local_cnt=" << local_cnt << '\n';
-            });
+    std::condition_variable buffer_free;
+    std::vector<pixel_buffer> buffers(pool.size() + 2);
+    std::deque<pixel_buffer*> free_buffers;
+    std::atomic<uint64_t> cnt{};
+
+    for (auto&& buffer : buffers)
+        free_buffers.push_back(&buffer);
 
-    for (auto&& worker : workers)
-        worker.join();
+    task_group group;
+    for (;;)
+    {
+        std::unique_lock lock(m);
+        buffer_free.wait(lock, [&] { return !free_buffers.empty(); });
+        auto* buffer = free_buffers.front();
+        free_buffers.pop_front();
+        lock.unlock();
+
+        const auto band = reader.read_rows(*buffer, band_rows);
+        if (!band.height)
+            break;
+
+        pool.submit(group, [&, buffer, band] {
+            phase_span span("compute", band.size());
+            cnt.fetch_add(count_product_below(band), std::memory_order_relaxed);
+
+            std::lock_guard _(m);
+            free_buffers.push_back(buffer);
+            buffer_free.notify_one();
+            });
+    }
+    pool.wait(group);
 
     return cnt;
 }
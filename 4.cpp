@@ -1,73 +1,78 @@
-#include <array>
-#include <cassert>
 #include <filesystem>
-#include <fstream>
 #include <iostream>
+#include <string>
 #include <vector>
 
 #include <omp.h>
 
+#include "bmp.h"
+#include "kernel.h"
+#include "metrics.h"
+#include "numa.h"
+#include "placed_image.h"
+
 static const std::filesystem::path INPUT_FILEPATH{ "img02.bmp" };
-static constexpr auto HEADER_SIZE{ 54U };
 static constexpr auto THREADS_NUM{ 5U };
 
-uint64_t proceed(const std::vector<char>& data);
+uint64_t proceed(const pixel_view& view, int threads_num = THREADS_NUM, pin_policy pin = default_pin_policy());
 
-int main()
+#ifndef NO_MAIN
+// `./4 numa` counts a copy placed on the nodes of the threads that scan it,
+// with the threads pinned by BGR_PIN, or scattered when it is not set.
+int main(int argc, char* argv[])
 {
-    std::ifstream input(INPUT_FILEPATH, std::ios::in | std::ios::binary);
-    if (!input.is_open())
+    const bmp_image image(INPUT_FILEPATH);
+    if (!image.is_open())
     {
         std::cerr << "Failed to open file: path=" << INPUT_FILEPATH << '\n';
         return -1;
     }
 
-    std::vector<char> data;
-    {
-        std::array<char, HEADER_SIZE> header;
-        input.read(header.data(), header.size());
-
-        const auto data_offset = *reinterpret_cast<uint32_t*>(&header[10]);
-        const auto width = *reinterpret_cast<uint32_t*>(&header[18]);
-        const auto height = *reinterpret_cast<uint32_t*>(&header[22]);
-        std::cout << "data_offset=" << data_offset << ", width=" << width << ", height=" << height << '\n';
-
-        data.resize(data_offset - HEADER_SIZE);
-        input.read(data.data(), data.size());
-
-        data.reserve(((width * 3 + 3) & (~3)) * height);
-
-        std::vector<char> row_padded((width * 3 + 3) & (~3));
-        for (size_t i{}; i < height; ++i)
-        {
-            input.read(row_padded.data(), row_padded.size());
-            for (size_t j{}; j < width * 3; j += 3)
-            {
-                data.push_back(row_padded[j]);
-                data.push_back(row_padded[j + 1]);
-                data.push_back(row_padded[j + 2]);
-            }
-        }
+    const auto& view = image.view();
+    std::cout << "data_offset=" << image.data_offset() << ", width=" << view.width << ", height=" << view.height << '\n';
 
-        assert(data.size() % 3 == 0);
+    if (argc >= 2 && std::string(argv[1]) == "numa")
+    {
+        const auto pin = default_pin_policy() != pin_policy::none ? default_pin_policy() : pin_policy::scatter;
+        const placed_image placed(view, openmp_policy{ static_cast<int>(THREADS_NUM) }, pin);
+        const auto res = proceed(placed.view(), THREADS_NUM, pin);
+        std::cout << "4: cnt=" << res << '\n';
+        return 0;
     }
 
-    const auto res = proceed(data);
+    const auto res = proceed(view);
     std::cout << "4: cnt=" << res << '\n';
 
     return 0;
 }
+#endif
 
-uint64_t proceed(const std::vector<char>& data)
+// Rows go out under a static schedule, so each thread scans the same block on
+// every call, and the block placed_image put on its node. The calling thread
+// is the team's thread 0 and gets its own mask back afterwards.
+uint64_t proceed(const pixel_view& view, int threads_num, pin_policy pin)
 {
     omp_set_dynamic(0);
-    omp_set_num_threads(THREADS_NUM);
+    omp_set_num_threads(threads_num);
+
+    std::vector<numa_topology::slot> slots;
+    if (pin != pin_policy::none)
+        slots = numa_topology::instance().plan(pin, threads_num);
+    const affinity_guard restore;
 
     uint64_t cnt{};
-#pragma omp parallel for num_threads(THREADS_NUM) reduction(+:cnt)
-    for (int i{}; i < data.size(); i += 3)
-        if (static_cast<size_t>(data[i]) * data[i + 1] * data[i + 2] < 1000)
-            ++cnt;
+#pragma omp parallel num_threads(threads_num) reduction(+:cnt)
+    {
+        if (static_cast<size_t>(omp_get_thread_num()) < slots.size())
+            pin_current_thread(slots[omp_get_thread_num()].cpu);
+        phase_span span("compute");
+#pragma omp for schedule(static)
+        for (size_t y = 0; y < view.height; ++y)
+        {
+            cnt += count_product_below(view.row(y), view.width);
+            span.add_bytes(view.row_size());
+        }
+    }
 
     return cnt;
 }
\ No newline at end of file
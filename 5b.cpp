@@ -1,29 +1,29 @@
 #define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
 #undef UNICODE
 
-#include <array>
-#include <cassert>
+#include <algorithm>
 #include <filesystem>
-#include <fstream>
 #include <iostream>
 #include <string>
-#include <vector>
 
 #include <Windows.h>
 #include <WinSock2.h>
 #include <ws2tcpip.h>
 
+#include "bmp.h"
+
 #pragma comment (lib, "Ws2_32.lib")
 #pragma comment (lib, "Mswsock.lib")
 #pragma comment (lib, "AdvApi32.lib")
 
 static const std::filesystem::path INPUT_FILEPATH{ "img03.bmp" };
-static constexpr auto HEADER_SIZE{ 54U };
 static constexpr auto CLIENTS_NUM{ 5U };
 
 int client();
 int server(std::string arg);
-uint64_t proceed(const std::vector<char>& data);
+uint64_t proceed(const pixel_view& view);
+int send_pixels(SOCKET sock, const pixel_view& view, size_t first, size_t last);
 
 int main(int argc, char* argv[])
 {
@@ -74,7 +74,7 @@ int client()
 	std::cout << "recv: " << buff << '\n';
 
 	const auto size = std::atoll(buff);
-	std::vector<char> data(size);
+	pixel_buffer data(size);
 
 	int recv_bytes{};
 	do {
@@ -83,7 +83,7 @@ int client()
 	} while (recv_bytes != size);
 	shutdown(sock, SD_RECEIVE);
 
-	auto result_cnt = std::to_string(proceed(data));
+	auto result_cnt = std::to_string(proceed(packed_view(data.data(), data.size())));
 	std::cout << "result: " << result_cnt << '\n';
 	send(sock, result_cnt.c_str(), static_cast<int>(result_cnt.size()), 0);
 
@@ -96,42 +96,15 @@ int client()
 
 int server(std::string arg)
 {
-	std::ifstream input(INPUT_FILEPATH, std::ios::in | std::ios::binary);
-	if (!input.is_open())
+	const bmp_image image(INPUT_FILEPATH);
+	if (!image.is_open())
 	{
 		std::cerr << "Failed to open file: path=" << INPUT_FILEPATH << '\n';
 		return -1;
 	}
 
-	std::vector<char> data;
-	{
-		std::array<char, HEADER_SIZE> header;
-		input.read(header.data(), header.size());
-
-		const auto data_offset = *reinterpret_cast<uint32_t*>(&header[10]);
-		const auto width = *reinterpret_cast<uint32_t*>(&header[18]);
-		const auto height = *reinterpret_cast<uint32_t*>(&header[22]);
-		std::cout << "data_offset=" << data_offset << ", width=" << width << ", height=" << height << '\n';
-
-		data.resize(data_offset - HEADER_SIZE);
-		input.read(data.data(), data.size());
-
-		data.reserve(((width * 3 + 3) & (~3)) * height);
-
-		std::vector<char> row_padded((width * 3 + 3) & (~3));
-		for (size_t i{}; i < height; ++i)
-		{
-			input.read(row_padded.data(), row_padded.size());
-			for (size_t j{}; j < width * 3; j += 3)
-			{
-				data.push_back(row_padded[j]);
-				data.push_back(row_padded[j + 1]);
-				data.push_back(row_padded[j + 2]);
-			}
-		}
-
-		assert(data.size() % 3 == 0);
-	}
+	const auto& view = image.view();
+	std::cout << "data_offset=" << image.data_offset() << ", width=" << view.width << ", height=" << view.height << '\n';
 
 	WSADATA wsaData;
 	WSAStartup(MAKEWORD(2, 2), &wsaData);
@@ -165,20 +138,16 @@ int server(std::string arg)
 
 		SOCKET client = accept(listen_sock, NULL, NULL);
 
-		const auto supply = (data.size() % CLIENTS_NUM) / 3;
+		const auto supply = (view.size() % CLIENTS_NUM) / 3;
 		const auto spl_tmp = CLIENTS_NUM - 1 - i;
-		const auto cull_data_size = data.size() - supply * 3;
-		const long end = data.size() - 1 - (i + 1) * cull_data_size / CLIENTS_NUM - 3 * (spl_tmp < supply ? (supply - spl_tmp) : 0);
-		const long start = data.size() - 1 - i * cull_data_size / CLIENTS_NUM - 3 * (spl_tmp < supply ? (supply - spl_tmp - 1) : 0);
+		const auto cull_data_size = view.size() - supply * 3;
+		const long end = view.size() - 1 - (i + 1) * cull_data_size / CLIENTS_NUM - 3 * (spl_tmp < supply ? (supply - spl_tmp) : 0);
+		const long start = view.size() - 1 - i * cull_data_size / CLIENTS_NUM - 3 * (spl_tmp < supply ? (supply - spl_tmp - 1) : 0);
 		auto size = std::to_string(start - end); size.resize(sizeof(uint64_t));
 		std::cout << "Sending client " << i << " size=" << size << '\n';
 		send(client, size.c_str(), static_cast<int>(size.size()), 0);
 
-		int send_bytes{};
-		do {
-			auto sd = send(client, &data[end + 1 + send_bytes], static_cast<int>(start - end), 0);
-			std::cout << "send " << sd << " total=" << (send_bytes += sd) << '\n';
-		} while (send_bytes != (start - end));
+		std::cout << "send total=" << send_pixels(client, view, end + 1, start + 1) << '\n';
 		shutdown(client, SD_SEND);
 
 		char buff[8]{};
@@ -199,12 +168,40 @@ int server(std::string arg)
 	return 0;
 }
 
-uint64_t proceed(const std::vector<char>& data)
+uint64_t proceed(const pixel_view& view)
 {
 	uint64_t cnt{};
-	for (size_t i{}; i < data.size(); i += 3)
-		if (static_cast<size_t>(data[i]) * data[i + 1] * data[i + 2] < 1000)
-			++cnt;
+	for (size_t y{}; y < view.height; ++y)
+	{
+		const auto* data = view.row(y);
+		for (size_t i{}; i < view.row_size(); i += 3)
+			if (static_cast<size_t>(data[i]) * data[i + 1] * data[i + 2] < 1000)
+				++cnt;
+	}
 
 	return cnt;
+}
+
+// Sends packed pixel bytes [first, last) row by row straight from the mapping.
+int send_pixels(SOCKET sock, const pixel_view& view, size_t first, size_t last)
+{
+	int total{};
+	for (auto pos = first; pos < last;)
+	{
+		const auto x = pos % view.row_size();
+		const auto len = std::min(view.row_size() - x, last - pos);
+		const auto* row = view.row(pos / view.row_size()) + x;
+
+		for (size_t sent{}; sent < len;)
+		{
+			auto sd = send(sock, row + sent, static_cast<int>(len - sent), 0);
+			if (sd == SOCKET_ERROR)
+				return total;
+			sent += sd;
+			total += sd;
+		}
+		pos += len;
+	}
+
+	return total;
 }
\ No newline at end of file
@@ -1,190 +1,1157 @@
-#include <array>
-#include <cassert>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
 #include <filesystem>
-#include <fstream>
 #include <iostream>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 
 #include <arpa/inet.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <signal.h>
 #include <string.h>
+#include <climits>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/uio.h>
 #include <sys/wait.h>
-#include <unistd.h> 
+#include <unistd.h>
+
+#include "bmp.h"
+#include "kernel.h"
+#include "metrics.h"
+#include "proto.h"
+#include "thread_pool.h"
 
 static const std::filesystem::path INPUT_FILEPATH{ "img01.bmp" };
-static constexpr auto HEADER_SIZE{ 54U };
 static constexpr auto CLIENTS_NUM{ 5U };
+static constexpr auto JOBS_IN_FLIGHT{ 2U };
+static constexpr size_t MIN_CHUNK_SIZE{ 3U << 14 };
+static constexpr size_t MAX_CHUNK_SIZE{ 3U << 22 };
+static constexpr auto TARGET_JOB_NS{ 2e6 };
+static constexpr auto POOL_CHUNK_SIZE{ 3U << 16 };
+static constexpr auto THRESHOLD{ 1000U };
 static constexpr auto PORT{ 12345 };
 
-int client();
-int server();
-uint64_t proceed(const std::vector<char>& data);
+// Every wait is bounded. A worker silent for WORKER_TIMEOUT is dead; a job
+// out for JOB_TIMEOUT is run again on another worker, up to MAX_RUNS copies.
+static constexpr std::chrono::milliseconds CONNECT_RETRY{ 100 };
+static constexpr auto CONNECT_ATTEMPTS{ 50U };
+static constexpr std::chrono::seconds ACCEPT_TIMEOUT{ 5 };
+static constexpr std::chrono::milliseconds WORKER_TIMEOUT{ 5 * HEARTBEAT_INTERVAL_MS };
+static constexpr std::chrono::milliseconds JOB_TIMEOUT{ 500 };
+static constexpr std::chrono::milliseconds TICK{ 50 };
+static constexpr auto MAX_RUNS{ 2U };
+
+using net_clock = std::chrono::steady_clock;
+
+// How a worker gets at its slice; no mode copies pixels in user space.
+//   copy      the rows are written to the socket straight from the mapping
+//   map       only offsets are sent; the worker maps INPUT_FILEPATH itself,
+//             so same-host workers share the page cache
+//   sendfile  the file range holding the slice, row padding included, goes
+//             from the page cache to the socket in the kernel; for workers
+//             that cannot see the file
+// For sendfile the payload starts at byte first % (width * 3) of its row.
+enum class transport : uint32_t { copy, map, sendfile };
+
+// A frame queued on a connection, followed by its pixels, either as iovecs
+// into the mapping or as a file range for sendfile.
+struct outgoing
+{
+	char frame[FRAME_HEADER_SIZE + JOB_BODY_SIZE]{};
+	std::vector<iovec> iov;
+	size_t next_iov{};
+	off_t file_offset{};
+	size_t file_left{};
+};
+
+// Packed byte range [first, last) handed out as one job. A job may be running
+// on several workers at once; the first result wins.
+struct job_state
+{
+	size_t first{};
+	size_t last{};
+	size_t runs{};
+	bool done{};
+	bool speculated{};
+};
 
-int main()
+// One accepted worker. Frames go out as the socket drains while results for
+// earlier jobs are read back in between. `in_flight` maps job ids to when
+// they were sent; `bytes_per_ns` is the worker's own measured rate, 0 until
+// its first result.
+struct connection
 {
-	return server();
+	int sock{ -1 };
+	bool alive{};
+	std::deque<outgoing> out;
+	std::string in;
+	std::unordered_map<uint64_t, net_clock::time_point> in_flight;
+	net_clock::time_point last_seen;
+	double bytes_per_ns{};
+	uint32_t cores{ 1 };
+	uint32_t workers{ 1 };
+};
+
+struct coordinator_options
+{
+	transport mode{ transport::map };
+	uint16_t port{ PORT };
+	size_t workers{ CLIENTS_NUM };
+	bool fork_workers{ true };
+	size_t kill_num{};
+	size_t stop_num{};
+};
+
+// Where a worker's coordinator is, how many cores it counts with and, when
+// listen_port is set, where further workers can register below it.
+struct worker_options
+{
+	std::string host{ "127.0.0.1" };
+	uint16_t port{ PORT };
+	uint16_t listen_port{};
+	uint32_t cores{ 1 };
+};
+
+// A worker registered below this one in the reduction tree.
+struct child_worker
+{
+	int sock{ -1 };
+	uint32_t cores{ 1 };
+	uint32_t workers{ 1 };
+	uint64_t next_job_id{};
+};
+
+int client(const worker_options& options);
+int server(const coordinator_options& options);
+uint64_t proceed(const pixel_view& view, uint32_t threshold = THRESHOLD);
+uint64_t proceed(const pixel_view& view, size_t first, size_t last, uint32_t threshold = THRESHOLD);
+uint64_t proceed(thread_pool& pool, const pixel_view& view, size_t first, size_t last, uint32_t threshold);
+uint64_t run_job(std::vector<child_worker>& children, thread_pool& pool, uint32_t cores, const job_body& job, const pixel_view& local, size_t offset, bool& cores_changed);
+size_t next_chunk_size(const connection& c, size_t remaining, size_t total_cores);
+int connect_to(const std::string& host, uint16_t port);
+int listen_on(uint16_t port);
+std::vector<iovec> pixel_iovecs(const pixel_view& view, size_t first, size_t last);
+bool send_some(int sock, std::vector<iovec>& iov, size_t& next);
+bool flush(connection& c, int file_fd);
+bool write_iovecs(int sock, std::vector<iovec> iov);
+bool read_frame(int sock, frame_header& header, char* body, size_t max_body);
+bool job_fits_frame(const frame_header& header, const job_body& job);
+bool read_full(int sock, char* data, size_t size);
+bool skip_full(int sock, size_t size);
+bool write_full(int sock, const char* data, size_t size);
+
+// 6b [copy|map|sendfile] [-k N] [-s N]
+//     coordinator with CLIENTS_NUM forked local workers; -k N kills N of them
+//     with SIGKILL and -s N freezes N more with SIGSTOP once the first result
+//     is in, to exercise the recovery paths
+// 6b serve [copy|map|sendfile] [-p port] [-w workers]
+//     coordinator alone, waiting for `workers` workers to register, those
+//     registered below other workers included
+// 6b worker host:port [-l listen_port] [-c cores]
+//     worker daemon; with -l, further workers can register below it and their
+//     counts are reduced here on the way up. map needs INPUT_FILEPATH on the
+//     worker's host; copy and sendfile do not.
+int main(int argc, char* argv[])
+{
+	// A worker dying mid-write must not take the coordinator down with it.
+	signal(SIGPIPE, SIG_IGN);
+
+	const std::string role = argc >= 2 ? argv[1] : "";
+	if (role == "worker" && argc >= 3)
+	{
+		worker_options options;
+		const std::string address = argv[2];
+		const auto colon = address.rfind(':');
+		options.host = address.substr(0, colon);
+		options.port = colon != std::string::npos ? std::atoi(address.c_str() + colon + 1) : PORT;
+		options.cores = std::max(1U, std::thread::hardware_concurrency());
+		for (int i{ 3 }; i + 1 < argc; i += 2)
+		{
+			const std::string arg = argv[i];
+			if (arg == "-l")
+				options.listen_port = std::atoi(argv[i + 1]);
+			else if (arg == "-c")
+				options.cores = std::max(1, std::atoi(argv[i + 1]));
+		}
+		return client(options);
+	}
+
+	coordinator_options options;
+	for (int i{ 1 }; i < argc; ++i)
+	{
+		const std::string arg = argv[i];
+		if (arg == "serve")
+			options.fork_workers = false;
+		else if (arg == "copy")
+			options.mode = transport::copy;
+		else if (arg == "map")
+			options.mode = transport::map;
+		else if (arg == "sendfile")
+			options.mode = transport::sendfile;
+		else if (arg == "-k" && i + 1 < argc)
+			options.kill_num = std::atoi(argv[++i]);
+		else if (arg == "-s" && i + 1 < argc)
+			options.stop_num = std::atoi(argv[++i]);
+		else if (arg == "-p" && i + 1 < argc)
+			options.port = std::atoi(argv[++i]);
+		else if (arg == "-w" && i + 1 < argc)
+			options.workers = std::max(1, std::atoi(argv[++i]));
+		else
+		{
+			std::cerr << "Usage: " << argv[0] << " [copy|map|sendfile] [-k kill_num] [-s stop_num]\n"
+				<< "       " << argv[0] << " serve [copy|map|sendfile] [-p port] [-w workers]\n"
+				<< "       " << argv[0] << " worker host:port [-l listen_port] [-c cores]\n";
+			return -1;
+		}
+	}
+
+	return server(options);
 }
 
-int client()
+// Registers with the coordinator, then runs the jobs it sends until bye. Each
+// job is split between this worker's own pool and the workers registered
+// below it, in proportion to their cores, and comes back as one count.
+int client(const worker_options& options)
 {
 	std::cout << "client: created\n";
-	// sleep(1);
 
-	struct sockaddr_in servaddr;
-	bzero(&servaddr, sizeof(servaddr));
-	servaddr.sin_family = AF_INET;
-	servaddr.sin_addr.s_addr = inet_addr("127.0.0.1");
-	servaddr.sin_port = htons(PORT);
-
-	auto sock = socket(AF_INET, SOCK_STREAM, 0);
-	while (1)
+	const auto sock = connect_to(options.host, options.port);
+	if (sock < 0)
 	{
-		auto rc = connect(sock, (struct sockaddr*)&servaddr, sizeof(servaddr));
-		std::cout << "client: connect rc=" << rc << " errno=" << errno << '\n';
-		if (!rc)
-			break;
+		std::cerr << "client: server unreachable\n";
+		return 1;
 	}
 	std::cout << "client: connected\n";
 
-	char buff[8];
-	read(sock, buff, sizeof(buff));
-	std::cout << "client: recv buff=" << buff << '\n';
+	thread_pool pool(options.cores);
+	std::mutex write_mutex;
+	std::mutex children_mutex;
+	std::vector<child_worker> children;
+
+	// Tells the coordinator how many workers and cores this subtree has; sent
+	// on connecting and again whenever a worker registers below.
+	const auto advertise = [&] {
+		hello_body hello{ options.cores, 1 };
+		{
+			std::lock_guard _(children_mutex);
+			for (auto&& child : children)
+			{
+				hello.cores += child.cores;
+				hello.workers += child.workers;
+			}
+		}
+
+		char frame[FRAME_HEADER_SIZE + HELLO_BODY_SIZE];
+		encode(frame_header{ frame_type::hello, 0, HELLO_BODY_SIZE }, frame);
+		encode(hello, frame + FRAME_HEADER_SIZE);
+		std::lock_guard _(write_mutex);
+		write_full(sock, frame, sizeof(frame));
+	};
+	advertise();
+
+	int listen_sock{ -1 };
+	std::thread acceptor;
+	if (options.listen_port)
+	{
+		listen_sock = listen_on(options.listen_port);
+		if (listen_sock < 0)
+			return 1;
+
+		acceptor = std::thread([&] {
+			for (int child; (child = accept(listen_sock, NULL, NULL)) >= 0;)
+			{
+				const timeval timeout{ std::chrono::duration_cast<std::chrono::seconds>(WORKER_TIMEOUT).count(),
+					static_cast<suseconds_t>(std::chrono::duration_cast<std::chrono::microseconds>(WORKER_TIMEOUT).count() % 1000000) };
+				// Bounds writes too: a frozen child that stops reading would
+				// otherwise block run_job's sends, and so this worker, for good.
+				setsockopt(child, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+				setsockopt(child, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+				frame_header header;
+				char body[HELLO_BODY_SIZE];
+				hello_body hello;
+				if (!read_frame(child, header, body, sizeof(body)) || header.type != frame_type::hello)
+				{
+					close(child);
+					continue;
+				}
+				decode(body, hello);
+				std::cout << "client: worker registered cores=" << hello.cores << " workers=" << hello.workers << '\n';
+				{
+					std::lock_guard _(children_mutex);
+					children.push_back({ child, std::max(1U, hello.cores), std::max(1U, hello.workers) });
+				}
+				advertise();
+			}
+			});
+	}
+
+	// Heartbeats go out from their own thread, so the coordinator hears from
+	// a worker that is alive even while it is deep in a long job.
+	std::condition_variable stop;
+	bool stopping{};
+	std::thread heartbeat([&] {
+		char frame[FRAME_HEADER_SIZE];
+		encode(frame_header{ frame_type::heartbeat, 0, 0 }, frame);
 
-	const auto size = std::atoll(buff);
-	std::vector<char> data(size);
+		std::unique_lock lock(write_mutex);
+		while (!stop.wait_for(lock, std::chrono::milliseconds(HEARTBEAT_INTERVAL_MS), [&] { return stopping; }))
+			if (!write_full(sock, frame, sizeof(frame)))
+				break;
+		});
+
+	std::unique_ptr<bmp_image> image;
+	pixel_buffer data;
+
+	for (;;)
+	{
+		char frame[FRAME_HEADER_SIZE + JOB_BODY_SIZE];
+		frame_header header;
+		if (!read_full(sock, frame, FRAME_HEADER_SIZE))
+			break;
+		if (!decode(frame, header))
+		{
+			std::cerr << "client: bad frame\n";
+			break;
+		}
+		if (header.type == frame_type::bye)
+			break;
 
-	int recv_bytes{};
-	do {
-		auto rc = read(sock, data.data() + recv_bytes, data.size());
-		recv_bytes += rc;
-		std::cout << "client: recv " << rc << " total=" << recv_bytes << '\n';
-		if (!rc)
+		job_body job;
+		if (header.type != frame_type::job || header.length < JOB_BODY_SIZE || !read_full(sock, frame + FRAME_HEADER_SIZE, JOB_BODY_SIZE))
 			break;
-	} while (recv_bytes != size);
+		decode(frame + FRAME_HEADER_SIZE, job);
+		std::cout << "client: job " << header.job_id << " first=" << job.first << " last=" << job.last << " payload=" << job.payload << '\n';
 
-	auto result_cnt = std::to_string(proceed(data));
-	std::cout << "client: result: " << result_cnt << '\n';
-	write(sock, result_cnt.c_str(), result_cnt.size());
+		// A job that cannot be laid out is answered with failed. Its payload
+		// is skipped when the frame length still says where it ends;
+		// otherwise the stream cannot be followed and the connection goes.
+		if (!job_fits_frame(header, job))
+		{
+			std::cerr << "client: job " << header.job_id << " is malformed, width=" << job.width << " length=" << header.length << '\n';
+			encode(frame_header{ frame_type::failed, header.job_id, 0 }, frame);
+			{
+				std::lock_guard _(write_mutex);
+				if (!write_full(sock, frame, FRAME_HEADER_SIZE))
+					break;
+			}
+			if (header.length - JOB_BODY_SIZE != job.payload || !skip_full(sock, job.payload))
+				break;
+			continue;
+		}
+
+		// The sendfile payload starts mid-row; receiving it `x` bytes into the
+		// buffer puts every row back at its stride.
+		const auto mode = static_cast<transport>(job.transport);
+		const auto stride = bmp_row_stride(job.width);
+		const auto x = mode == transport::sendfile ? job.first % (job.width * 3) : 0;
+
+		const auto recv_start = net_clock::now();
+		data.resize(x + job.payload);
+		{
+			phase_span span("recv", job.payload);
+			if (!read_full(sock, data.data() + x, job.payload))
+				break;
+		}
+
+		// `local` holds the job's pixels, image byte p at local position
+		// p - job.first + offset.
+		pixel_view local;
+		size_t offset{};
+		if (mode == transport::map)
+		{
+			if (!image)
+				image = std::make_unique<bmp_image>(INPUT_FILEPATH);
+			if (!image->is_open())
+				break;
+			local = image->view();
+			offset = job.first;
+
+			// The range is in the coordinator's image; this host's copy may be
+			// another size or truncated, and must not be read past its end.
+			if (job.width != local.width || job.first > job.last || job.last > local.size())
+			{
+				std::cerr << "client: job " << header.job_id << " is outside the local image, size=" << local.size() << '\n';
+				encode(frame_header{ frame_type::failed, header.job_id, 0 }, frame);
+				std::lock_guard _(write_mutex);
+				if (!write_full(sock, frame, FRAME_HEADER_SIZE))
+					break;
+				continue;
+			}
+		}
+		else if (mode == transport::sendfile)
+		{
+			local = { data.data(), job.width, (data.size() + stride - 1) / stride, stride };
+			offset = x;
+		}
+		else
+			local = packed_view(data.data(), data.size());
 
+		const auto compute_start = net_clock::now();
+		result_body result;
+		bool cores_changed{};
+		{
+			phase_span span("compute", job.last - job.first);
+			std::lock_guard _(children_mutex);
+			result.cnt = run_job(children, pool, options.cores, job, local, offset, cores_changed);
+		}
+		if (cores_changed)
+			advertise();
+
+		const auto end = net_clock::now();
+		result.recv_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(compute_start - recv_start).count();
+		result.compute_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(end - compute_start).count();
+		std::cout << "client: result: " << result.cnt << '\n';
+
+		encode(frame_header{ frame_type::result, header.job_id, RESULT_BODY_SIZE }, frame);
+		encode(result, frame + FRAME_HEADER_SIZE);
+		phase_span span("send", FRAME_HEADER_SIZE + RESULT_BODY_SIZE);
+		std::lock_guard _(write_mutex);
+		if (!write_full(sock, frame, FRAME_HEADER_SIZE + RESULT_BODY_SIZE))
+			break;
+	}
+
+	{
+		std::lock_guard _(write_mutex);
+		stopping = true;
+	}
+	stop.notify_one();
+	heartbeat.join();
+
+	if (acceptor.joinable())
+	{
+		shutdown(listen_sock, SHUT_RDWR);
+		acceptor.join();
+		close(listen_sock);
+	}
+
+	// The subtree goes down with this worker.
+	char bye[FRAME_HEADER_SIZE];
+	encode(frame_header{ frame_type::bye, 0, 0 }, bye);
+	for (auto&& child : children)
+	{
+		write_full(child.sock, bye, sizeof(bye));
+		close(child.sock);
+	}
 	close(sock);
 
 	return 0;
 }
 
-int server()
+int server(const coordinator_options& options)
 {
-	std::ifstream input(INPUT_FILEPATH, std::ios::in | std::ios::binary);
-	if (!input.is_open())
+	const auto mode = options.mode;
+	auto kill_num = options.kill_num, stop_num = options.stop_num;
+
+	const bmp_image image(INPUT_FILEPATH);
+	const auto file_fd = open(INPUT_FILEPATH.c_str(), O_RDONLY);
+	if (!image.is_open() || file_fd < 0)
 	{
 		std::cerr << "Failed to open file: path=" << INPUT_FILEPATH << '\n';
 		return -1;
 	}
 
-	std::vector<char> data;
+	const auto& view = image.view();
+	std::cout << "data_offset=" << image.data_offset() << ", width=" << view.width << ", height=" << view.height << '\n';
+
+	const auto listen_sock = listen_on(options.port);
+	if (listen_sock < 0)
+		return 1;
+	fcntl(listen_sock, F_SETFL, O_NONBLOCK);
+
+	// Forked workers are all started up front and share the machine's cores;
+	// slices then stream to all of them at once and results are collected in
+	// whatever order they finish.
+	std::vector<pid_t> workers;
+	auto forking = std::make_unique<phase_span>("fork");
+	for (size_t i{}; options.fork_workers && i < options.workers; ++i)
+	{
+		const auto pid = fork();
+		if (!pid)
+		{
+			forking->discard();
+			close(listen_sock);
+			worker_options worker;
+			worker.port = options.port;
+			worker.cores = std::max<uint32_t>(1, std::thread::hardware_concurrency() / options.workers);
+			return client(worker);
+		}
+		workers.push_back(pid);
+	}
+	forking.reset();
+
+	static constexpr auto LISTEN_ID{ ~uint64_t{} };
+	const auto epoll_fd = epoll_create1(0);
+	const auto watch = [epoll_fd](int op, int fd, uint32_t events, uint64_t id) {
+		epoll_event ev{};
+		ev.events = events;
+		ev.data.u64 = id;
+		epoll_ctl(epoll_fd, op, fd, &ev);
+	};
+	watch(EPOLL_CTL_ADD, listen_sock, EPOLLIN, LISTEN_ID);
+
+	std::vector<job_state> jobs;
+	std::deque<uint64_t> retry;
+	size_t next_byte{}, jobs_done{};
+	uint64_t total_cnt{};
+
+	std::vector<connection> connections(options.workers);
+	size_t accepted{}, live{};
+
+	const auto queue_job = [&](connection& c, uint64_t job_id) {
+		const auto first = jobs[job_id].first, last = jobs[job_id].last;
+		auto& o = c.out.emplace_back();
+		job_body job{ static_cast<uint32_t>(mode), THRESHOLD, first, last, view.width, 0 };
+		if (mode == transport::copy)
+		{
+			o.iov = pixel_iovecs(view, first, last);
+			job.payload = last - first;
+		}
+		else if (mode == transport::sendfile)
+		{
+			const auto file_pos = [&view, &image](size_t pos) {
+				return image.data_offset() + pos / view.row_size() * view.stride + pos % view.row_size();
+			};
+			o.file_offset = file_pos(first);
+			o.file_left = file_pos(last - 1) + 1 - o.file_offset;
+			job.payload = o.file_left;
+		}
+		encode(frame_header{ frame_type::job, job_id, JOB_BODY_SIZE + job.payload }, o.frame);
+		encode(job, o.frame + FRAME_HEADER_SIZE);
+		o.iov.insert(o.iov.begin(), { o.frame, sizeof(o.frame) });
+
+		++jobs[job_id].runs;
+		c.in_flight[job_id] = net_clock::now();
+	};
+
+	// The job to hand a worker next: a lost or straggling job first, then a
+	// new chunk off the cursor, then, once the image is handed out, a second
+	// copy of the oldest job still running elsewhere.
+	const auto next_job = [&](const connection& c) {
+		for (auto it = retry.begin(); it != retry.end();)
+			if (jobs[*it].done)
+				it = retry.erase(it);
+			else if (!c.in_flight.count(*it))
+			{
+				const auto id = *it;
+				retry.erase(it);
+				return id;
+			}
+			else
+				++it;
+
+		if (next_byte < view.size())
+		{
+			size_t total_cores{};
+			for (auto&& other : connections)
+				total_cores += other.alive ? other.cores : 0;
+
+			const auto size = next_chunk_size(c, view.size() - next_byte, total_cores);
+			jobs.push_back({ next_byte, next_byte + size });
+			next_byte += size;
+			return static_cast<uint64_t>(jobs.size() - 1);
+		}
+
+		auto oldest = ~uint64_t{};
+		net_clock::time_point oldest_start;
+		for (auto&& other : connections)
+			for (auto&& [id, start] : other.in_flight)
+				if (!jobs[id].done && jobs[id].runs < MAX_RUNS && !c.in_flight.count(id) && (oldest == ~uint64_t{} || start < oldest_start))
+				{
+					oldest = id;
+					oldest_start = start;
+				}
+		return oldest;
+	};
+
+	const auto fail = [&](connection& c, size_t i, const char* reason) {
+		std::cerr << "server: client " << i << ' ' << reason << ", re-dispatching " << c.in_flight.size() << " jobs\n";
+		for (auto&& [id, start] : c.in_flight)
+			if (--jobs[id].runs == 0 && !jobs[id].done)
+				retry.push_back(id);
+
+		close(c.sock);
+		c.in_flight.clear();
+		c.out.clear();
+		c.alive = false;
+		--live;
+	};
+
+	const auto all_done = [&] { return next_byte == view.size() && jobs_done == jobs.size(); };
+	const auto start = net_clock::now();
+	bool listening{ true };
+	auto registering = std::make_unique<phase_span>("register");
+	std::unique_ptr<phase_span> dispatching;
+
+	while (!all_done())
+	{
+		if (!listening && !live)
+		{
+			std::cerr << "server: no workers left\n";
+			break;
+		}
+
+		std::vector<epoll_event> events(options.workers + 1);
+		const auto n = epoll_wait(epoll_fd, events.data(), static_cast<int>(events.size()), static_cast<int>(TICK.count()));
+		if (n < 0 && errno != EINTR)
+		{
+			perror("epoll_wait failed: ");
+			break;
+		}
+
+		for (int e{}; e < n; ++e)
+		{
+			if (events[e].data.u64 == LISTEN_ID)
+			{
+				for (int sock; accepted < options.workers && (sock = accept4(listen_sock, NULL, NULL, SOCK_NONBLOCK)) >= 0; ++accepted)
+				{
+					std::cout << "server: client " << accepted << " connected\n";
+
+					auto& c = connections[accepted];
+					c.sock = sock;
+					c.alive = true;
+					c.last_seen = net_clock::now();
+					++live;
+					watch(EPOLL_CTL_ADD, sock, EPOLLIN, accepted);
+				}
+				continue;
+			}
+
+			const auto i = events[e].data.u64;
+			auto& c = connections[i];
+			if (!c.alive || !(events[e].events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+				continue;
+
+			char buff[4096];
+			ssize_t rc;
+			{
+				phase_span span("recv");
+				while ((rc = read(c.sock, buff, sizeof(buff))) > 0)
+				{
+					c.in.append(buff, rc);
+					span.add_bytes(rc);
+				}
+			}
+			bool failed = rc == 0 || errno != EAGAIN;
+			const char* reason = "lost";
+			c.last_seen = net_clock::now();
+
+			size_t pos{};
+			frame_header header;
+			while (!failed && c.in.size() - pos >= FRAME_HEADER_SIZE)
+			{
+				if (!decode(c.in.data() + pos, header) || header.length > std::max(RESULT_BODY_SIZE, HELLO_BODY_SIZE))
+				{
+					failed = true;
+					break;
+				}
+				if (c.in.size() - pos < FRAME_HEADER_SIZE + header.length)
+					break;
+
+				if (header.type == frame_type::result)
+				{
+					const auto job = c.in_flight.find(header.job_id);
+					if (job == c.in_flight.end() || header.length != RESULT_BODY_SIZE)
+					{
+						failed = true;
+						break;
+					}
+					c.in_flight.erase(job);
+
+					result_body result;
+					decode(c.in.data() + pos + FRAME_HEADER_SIZE, result);
+
+					auto& j = jobs[header.job_id];
+					const auto bytes = j.last - j.first;
+					const auto rate = bytes / std::max(1.0, static_cast<double>(result.recv_ns + result.compute_ns));
+					c.bytes_per_ns = c.bytes_per_ns ? (c.bytes_per_ns + rate) / 2 : rate;
+					--j.runs;
+
+					std::cout << "server: recv from client " << i << " job=" << header.job_id << " bytes=" << bytes << " cnt=" << result.cnt
+						<< " recv_us=" << result.recv_ns / 1000 << " compute_us=" << result.compute_ns / 1000 << (j.done ? " (duplicate)" : "") << '\n';
+					if (!j.done)
+					{
+						j.done = true;
+						total_cnt += result.cnt;
+						++jobs_done;
+					}
+				}
+				else if (header.type == frame_type::failed)
+				{
+					// Its jobs are re-dispatched to the other workers; one that
+					// cannot count this range will not count the next ones.
+					failed = true;
+					reason = "failed a job";
+					break;
+				}
+				else if (header.type == frame_type::hello && header.length == HELLO_BODY_SIZE)
+				{
+					hello_body hello;
+					decode(c.in.data() + pos + FRAME_HEADER_SIZE, hello);
+					c.cores = std::max(1U, hello.cores);
+					c.workers = std::max(1U, hello.workers);
+					std::cout << "server: client " << i << " registered cores=" << c.cores << " workers=" << c.workers << '\n';
+				}
+				else if (header.type != frame_type::heartbeat)
+				{
+					failed = true;
+					break;
+				}
+				pos += FRAME_HEADER_SIZE + header.length;
+			}
+			c.in.erase(0, pos);
+
+			if (failed)
+				fail(c, i, reason);
+		}
+
+		const auto now = net_clock::now();
+		for (size_t i{}; i < accepted; ++i)
+		{
+			auto& c = connections[i];
+			if (!c.alive)
+				continue;
+			if (now - c.last_seen > WORKER_TIMEOUT)
+			{
+				fail(c, i, "timed out");
+				continue;
+			}
+			for (auto&& [id, sent] : c.in_flight)
+				if (now - sent > JOB_TIMEOUT && !jobs[id].done && !jobs[id].speculated)
+				{
+					std::cerr << "server: job " << id << " on client " << i << " is late, running it again\n";
+					jobs[id].speculated = true;
+					retry.push_back(id);
+				}
+		}
+
+		if ((kill_num || stop_num) && jobs_done)
+		{
+			for (size_t i{}; i < workers.size() && i < kill_num + stop_num; ++i)
+			{
+				std::cerr << "server: " << (i < kill_num ? "killing" : "stopping") << " worker pid=" << workers[i] << '\n';
+				kill(workers[i], i < kill_num ? SIGKILL : SIGSTOP);
+			}
+			kill_num = stop_num = 0;
+		}
+
+		// Nothing is handed out until every worker has registered, directly or
+		// below another one, or the wait for them has timed out.
+		size_t registered{};
+		for (auto&& c : connections)
+			registered += c.alive ? c.workers : 0;
+		if (listening && (accepted == options.workers || registered >= options.workers || net_clock::now() - start > ACCEPT_TIMEOUT))
+		{
+			epoll_ctl(epoll_fd, EPOLL_CTL_DEL, listen_sock, NULL);
+			listening = false;
+			registering.reset();
+			dispatching = std::make_unique<phase_span>("dispatch", view.size());
+		}
+
+		for (size_t i{}; i < accepted && !listening; ++i)
+		{
+			auto& c = connections[i];
+			if (!c.alive)
+				continue;
+			for (uint64_t id; c.in_flight.size() < JOBS_IN_FLIGHT && (id = next_job(c)) != ~uint64_t{};)
+				queue_job(c, id);
+
+			if (!c.out.empty() && !flush(c, file_fd))
+				fail(c, i, "lost");
+			else
+				watch(EPOLL_CTL_MOD, c.sock, c.out.empty() ? EPOLLIN : EPOLLIN | EPOLLOUT, i);
+		}
+	}
+
+	dispatching.reset();
+
+	for (auto&& c : connections)
+		if (c.alive)
+		{
+			c.out.clear();
+			encode(frame_header{ frame_type::bye, 0, 0 }, c.out.emplace_back().frame);
+			c.out.back().iov = { { c.out.back().frame, FRAME_HEADER_SIZE } };
+			flush(c, file_fd);
+			close(c.sock);
+		}
+	close(epoll_fd);
+	close(file_fd);
+	close(listen_sock);
+
+	// Workers exit on bye or EOF; whatever is still around after a grace
+	// period, e.g. a frozen one, is killed.
+	const auto reap_deadline = net_clock::now() + std::chrono::seconds(1);
+	for (auto pid : workers)
+		while (waitpid(pid, NULL, WNOHANG) == 0)
+			if (net_clock::now() < reap_deadline)
+				std::this_thread::sleep_for(std::chrono::milliseconds(10));
+			else
+			{
+				kill(pid, SIGKILL);
+				waitpid(pid, NULL, 0);
+			}
+
+	if (!all_done())
+	{
+		std::cerr << "6b: failed, " << jobs.size() - jobs_done << " jobs unfinished and " << view.size() - next_byte << " bytes never sent\n";
+		return 1;
+	}
+
+	std::cout << "6b: total_cnt: " << total_cnt << '\n';
+
+	return 0;
+}
+//
+uint64_t proceed(const pixel_view& view, uint32_t threshold)
+{
+	return count_product_below(view, threshold);
+}
+
+// Counts packed pixel bytes [first, last) of the view in place.
+uint64_t proceed(const pixel_view& view, size_t first, size_t last, uint32_t threshold)
+{
+	uint64_t cnt{};
+	for (auto&& segment : pixel_iovecs(view, first, last))
+		cnt += proceed(packed_view(static_cast<const char*>(segment.iov_base), segment.iov_len), threshold);
+
+	return cnt;
+}
+
+// Bytes for a worker's next job: about TARGET_JOB_NS of work at its measured
+// rate (one minimal chunk per advertised core before the first result), but
+// at most its cores' share of what is left, so chunks shrink towards the end
+// and the workers finish together.
+size_t next_chunk_size(const connection& c, size_t remaining, size_t total_cores)
+{
+	auto size = c.bytes_per_ns ? static_cast<size_t>(c.bytes_per_ns * TARGET_JOB_NS) : MIN_CHUNK_SIZE * c.cores;
+	size = std::clamp(size, MIN_CHUNK_SIZE, MAX_CHUNK_SIZE);
+	size = std::min(size, std::max(MIN_CHUNK_SIZE, remaining * c.cores / std::max<size_t>(1, total_cores)));
+	return std::min(size / 3 * 3, remaining);
+}
+
+// Counts packed pixel bytes [first, last) of the view on the pool.
+uint64_t proceed(thread_pool& pool, const pixel_view& view, size_t first, size_t last, uint32_t threshold)
+{
+	std::atomic<uint64_t> cnt{};
+	pool.parallel_for(0, (last - first) / 3, POOL_CHUNK_SIZE / 3, [&](size_t begin, size_t end) {
+		cnt.fetch_add(proceed(view, first + begin * 3, first + end * 3, threshold), std::memory_order_relaxed);
+		});
+
+	return cnt;
+}
+
+// One node of the reduction tree. The job is cut in proportion to cores: the
+// children's parts go out first (as offsets for map, as copied pixels
+// otherwise), this worker counts its own part on its pool meanwhile, and the
+// children's counts are added as they come back. A child that fails, stays
+// silent or stops taking its part past WORKER_TIMEOUT is dropped and its part
+// counted here.
+uint64_t run_job(std::vector<child_worker>& children, thread_pool& pool, uint32_t cores, const job_body& job, const pixel_view& local, size_t offset, bool& cores_changed)
+{
+	const auto pos = [&job, offset](size_t p) { return p - job.first + offset; };
+	const auto map = static_cast<transport>(job.transport) == transport::map;
+
+	size_t total_cores{ cores };
+	for (auto&& child : children)
+		total_cores += child.cores;
+
+	const auto pixels = (job.last - job.first) / 3;
+	std::vector<size_t> bounds{ job.first, job.first + pixels * cores / total_cores * 3 };
+	for (size_t i{}, cum{ cores }; i < children.size(); ++i)
+	{
+		cum += children[i].cores;
+		bounds.push_back(job.first + pixels * cum / total_cores * 3);
+	}
+
+	std::vector<uint64_t> sent(children.size(), ~uint64_t{});
+	for (size_t i{}; i < children.size(); ++i)
 	{
-		std::array<char, HEADER_SIZE> header;
-		input.read(header.data(), header.size());
+		const auto first = bounds[i + 1], last = bounds[i + 2];
+		if (first == last)
+			continue;
+
+		const job_body part{ static_cast<uint32_t>(map ? transport::map : transport::copy), job.threshold, first, last, job.width, map ? 0 : last - first };
+		char frame[FRAME_HEADER_SIZE + JOB_BODY_SIZE];
+		const auto id = children[i].next_job_id++;
+		encode(frame_header{ frame_type::job, id, JOB_BODY_SIZE + part.payload }, frame);
+		encode(part, frame + FRAME_HEADER_SIZE);
 
-		const auto data_offset = *reinterpret_cast<uint32_t*>(&header[10]);
-		const auto width = *reinterpret_cast<uint32_t*>(&header[18]);
-		const auto height = *reinterpret_cast<uint32_t*>(&header[22]);
-		std::cout << "data_offset=" << data_offset << ", width=" << width << ", height=" << height << '\n';
+		auto iov = map ? std::vector<iovec>{} : pixel_iovecs(local, pos(first), pos(last));
+		iov.insert(iov.begin(), { frame, sizeof(frame) });
+		if (write_iovecs(children[i].sock, std::move(iov)))
+			sent[i] = id;
+	}
 
-		data.resize(data_offset - HEADER_SIZE);
-		input.read(data.data(), data.size());
+	auto cnt = proceed(pool, local, pos(bounds[0]), pos(bounds[1]), job.threshold);
 
-		data.reserve(((width * 3 + 3) & (~3)) * height);
+	for (size_t i{}; i < children.size(); ++i)
+	{
+		if (bounds[i + 1] == bounds[i + 2])
+			continue;
 
-		std::vector<char> row_padded((width * 3 + 3) & (~3));
-		for (size_t i{}; i < height; ++i)
+		bool ok = sent[i] != ~uint64_t{};
+		for (frame_header header; ok;)
 		{
-			input.read(row_padded.data(), row_padded.size());
-			for (size_t j{}; j < width * 3; j += 3)
+			char body[std::max(RESULT_BODY_SIZE, HELLO_BODY_SIZE)];
+			ok = read_frame(children[i].sock, header, body, sizeof(body));
+			if (!ok)
+				break;
+
+			if (header.type == frame_type::result && header.job_id == sent[i])
+			{
+				result_body result;
+				decode(body, result);
+				cnt += result.cnt;
+				break;
+			}
+			if (header.type == frame_type::hello)
 			{
-				data.push_back(row_padded[j]);
-				data.push_back(row_padded[j + 1]);
-				data.push_back(row_padded[j + 2]);
+				hello_body hello;
+				decode(body, hello);
+				children[i].cores = std::max(1U, hello.cores);
+				children[i].workers = std::max(1U, hello.workers);
+				cores_changed = true;
 			}
+			else if (header.type != frame_type::heartbeat)
+				ok = false;
 		}
 
-		assert(data.size() % 3 == 0);
+		if (!ok)
+		{
+			std::cerr << "client: worker below failed, counting its part here\n";
+			cnt += proceed(pool, local, pos(bounds[i + 1]), pos(bounds[i + 2]), job.threshold);
+			close(children[i].sock);
+			children[i].sock = -1;
+			cores_changed = true;
+		}
 	}
-	input.close();
 
+	children.erase(std::remove_if(children.begin(), children.end(), [](const child_worker& child) { return child.sock < 0; }), children.end());
+
+	return cnt;
+}
+
+// Packed pixel bytes [first, last) as pointers straight into the image rows,
+// skipping row padding without staging the bytes in a buffer.
+std::vector<iovec> pixel_iovecs(const pixel_view& view, size_t first, size_t last)
+{
+	std::vector<iovec> iov;
+	for (auto pos = first; pos < last;)
+	{
+		const auto x = pos % view.row_size();
+		const auto len = std::min(view.row_size() - x, last - pos);
+		iov.push_back({ const_cast<char*>(view.row(pos / view.row_size()) + x), len });
+		pos += len;
+	}
+
+	return iov;
+}
+
+// Writes as much of iov[next..] as the non-blocking socket takes and advances
+// `next` past what was sent. Returns false on a socket error.
+bool send_some(int sock, std::vector<iovec>& iov, size_t& next)
+{
+	while (next < iov.size())
+	{
+		auto rc = writev(sock, &iov[next], static_cast<int>(std::min<size_t>(iov.size() - next, IOV_MAX)));
+		if (rc < 0)
+			return errno == EAGAIN;
+
+		for (; next < iov.size() && static_cast<size_t>(rc) >= iov[next].iov_len; ++next)
+			rc -= iov[next].iov_len;
+		if (rc)
+		{
+			iov[next].iov_base = static_cast<char*>(iov[next].iov_base) + rc;
+			iov[next].iov_len -= rc;
+		}
+	}
+
+	return true;
+}
+
+// Sends queued frames, and their file ranges, until the socket would block.
+// Returns false on a socket error.
+bool flush(connection& c, int file_fd)
+{
+	phase_span span("send");
+	while (!c.out.empty())
+	{
+		auto& o = c.out.front();
+		size_t unsent{};
+		for (auto i = o.next_iov; metrics_enabled && i < o.iov.size(); ++i)
+			unsent += o.iov[i].iov_len;
+		const auto ok = send_some(c.sock, o.iov, o.next_iov);
+		for (auto i = o.next_iov; metrics_enabled && i < o.iov.size(); ++i)
+			unsent -= o.iov[i].iov_len;
+		span.add_bytes(unsent);
+		if (!ok)
+			return false;
+		if (o.next_iov < o.iov.size())
+			return true;
+
+		while (o.file_left)
+		{
+			const auto rc = sendfile(c.sock, file_fd, &o.file_offset, o.file_left);
+			if (rc <= 0)
+				return rc < 0 && errno == EAGAIN;
+			o.file_left -= rc;
+			span.add_bytes(rc);
+		}
+		c.out.pop_front();
+	}
+
+	return true;
+}
+
+// Whether `job` has a width, a range and a payload of the size its transport
+// sends for that range, and whether the frame length covers exactly that.
+bool job_fits_frame(const frame_header& header, const job_body& job)
+{
+	// BMP widths fit in 31 bits; the bound keeps the row arithmetic below and
+	// in the client from overflowing.
+	if (!job.width || job.width > INT32_MAX || job.first > job.last || job.last > SIZE_MAX / 2)
+		return false;
+	if (header.length - JOB_BODY_SIZE != job.payload)
+		return false;
+
+	const auto row_size = job.width * 3;
+	const auto stride = bmp_row_stride(job.width);
+	const auto file_pos = [&](uint64_t pos) { return pos / row_size * stride + pos % row_size; };
+	switch (static_cast<transport>(job.transport))
+	{
+	case transport::copy: return job.payload == job.last - job.first;
+	case transport::map: return job.payload == 0;
+	case transport::sendfile: return job.payload == (job.first < job.last ? file_pos(job.last - 1) + 1 - file_pos(job.first) : 0);
+	default: return false;
+	}
+}
+
+bool read_full(int sock, char* data, size_t size)
+{
+	for (size_t got{}; got < size;)
+	{
+		auto rc = read(sock, data + got, size - got);
+		if (rc <= 0)
+			return false;
+		got += rc;
+	}
+
+	return true;
+}
+
+// Reads and drops `size` bytes.
+bool skip_full(int sock, size_t size)
+{
+	char buffer[4096];
+	for (size_t left = size; left;)
+	{
+		const auto part = std::min(left, sizeof(buffer));
+		if (!read_full(sock, buffer, part))
+			return false;
+		left -= part;
+	}
+
+	return true;
+}
+
+bool write_full(int sock, const char* data, size_t size)
+{
+	for (size_t sent{}; sent < size;)
+	{
+		auto rc = write(sock, data + sent, size - sent);
+		if (rc <= 0)
+			return false;
+		sent += rc;
+	}
+
+	return true;
+}
+
+// Connects to host:port, retrying CONNECT_ATTEMPTS times while the other side
+// is not up yet. Returns -1 if it never comes up.
+int connect_to(const std::string& host, uint16_t port)
+{
+	addrinfo hints{}, *addr{};
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &addr) != 0)
+		return -1;
+
+	int sock{ -1 };
+	for (size_t attempt{}; sock < 0 && attempt < CONNECT_ATTEMPTS; ++attempt)
+	{
+		sock = socket(AF_INET, SOCK_STREAM, 0);
+		auto rc = connect(sock, addr->ai_addr, addr->ai_addrlen);
+		std::cout << "client: connect rc=" << rc << " errno=" << errno << '\n';
+		if (rc)
+		{
+			close(sock);
+			sock = -1;
+			std::this_thread::sleep_for(CONNECT_RETRY);
+		}
+	}
+	freeaddrinfo(addr);
+
+	return sock;
+}
+
+int listen_on(uint16_t port)
+{
 	struct sockaddr_in servaddr;
 	bzero(&servaddr, sizeof(servaddr));
 	servaddr.sin_family = AF_INET;
 	servaddr.sin_addr.s_addr = htonl(INADDR_ANY);
-	servaddr.sin_port = htons(PORT);
+	servaddr.sin_port = htons(port);
 
 	auto listen_sock = socket(AF_INET, SOCK_STREAM, 0);
+	if (listen_sock < 0)
+	{
+		perror("Socket creation failed: ");
+		return -1;
+	}
 	const int enable = 1;
 	if (setsockopt(listen_sock, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(int)) < 0)
 		perror("setsockopt(SO_REUSEADDR) failed");
 	if (bind(listen_sock, (struct sockaddr*)&servaddr, sizeof(servaddr)) != 0)
 	{
 		perror("Bind failed: ");
-		return 1;
+		close(listen_sock);
+		return -1;
 	}
-	assert(0 == listen(listen_sock, SOMAXCONN));
-
-	uint64_t total_cnt{};
-	for (size_t i{}; i < CLIENTS_NUM; ++i)
+	if (listen(listen_sock, SOMAXCONN) != 0)
 	{
-		struct sockaddr_in clientaddr;
-		socklen_t len = sizeof((struct sockaddr*)&clientaddr);
-		if (!fork())
-		{
-			close(listen_sock);
-			return client();
-		}
-
-		int client{};
-		do
-		{
-			client = accept(listen_sock, (struct sockaddr*)&clientaddr, &len);
-			std::cout << "server: accept rc=" << client << " errno=" << errno << '\n';
-		} while (client < 0);
-		std::cout << "server: client connected\n";
-
-		const auto supply = (data.size() % CLIENTS_NUM) / 3;
-		const auto spl_tmp = CLIENTS_NUM - 1 - i;
-		const auto cull_data_size = data.size() - supply * 3;
-		const long end = data.size() - 1 - (i + 1) * cull_data_size / CLIENTS_NUM - 3 * (spl_tmp < supply ? (supply - spl_tmp) : 0);
-		const long start = data.size() - 1 - i * cull_data_size / CLIENTS_NUM - 3 * (spl_tmp < supply ? (supply - spl_tmp - 1) : 0);
-		auto size = std::to_string(start - end); size.resize(sizeof(uint64_t));
-		std::cout << "server: sending client " << i << " size=" << size << '\n';
-		write(client, size.c_str(), size.size());
-
-		int send_bytes{};
-		do {
-			auto sd = write(client, &data[end + 1 + send_bytes], static_cast<size_t>(start - end));
-			send_bytes += sd;
-			std::cout << "server: send " << sd << " total=" << send_bytes << '\n';
-			if (!sd)
-				break;
-		} while (send_bytes != (start - end));
-
-		char buff[8]{};
-		read(client, buff, 8);
-		std::cout << "server: recv from client " << i << " buff=" << buff << '\n';
-		total_cnt += std::atoll(buff);
-		close(client);
-		wait(NULL);
+		perror("Listen failed: ");
+		close(listen_sock);
+		return -1;
 	}
-	std::cout << "6b: total_cnt: " << total_cnt << '\n';
-	close(listen_sock);
 
-	return 0;
+	return listen_sock;
 }
-//
-uint64_t proceed(const std::vector<char>& data)
+
+// Writes all of iov to a blocking socket. False on an error, or once the
+// socket's send timeout runs out.
+bool write_iovecs(int sock, std::vector<iovec> iov)
 {
-	uint64_t cnt{};
-	for (size_t i{}; i < data.size(); i += 3)
-		if (static_cast<size_t>(data[i]) * data[i + 1] * data[i + 2] < 1000)
-			++cnt;
+	size_t next{};
+	return send_some(sock, iov, next) && next == iov.size();
+}
 
-	return cnt;
+// Reads one frame whose body fits in max_body bytes.
+bool read_frame(int sock, frame_header& header, char* body, size_t max_body)
+{
+	char frame[FRAME_HEADER_SIZE];
+	return read_full(sock, frame, sizeof(frame)) && decode(frame, header) && header.length <= max_body
+		&& read_full(sock, body, header.length);
 }
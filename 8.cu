@@ -1,79 +1,63 @@
-﻿#include <array>
-#include <cassert>
 #include <filesystem>
-#include <fstream>
 #include <iostream>
-#include <vector>
 
 #include <cuda_runtime.h>
 #include <cooperative_groups.h>
 #include <device_launch_parameters.h>
 
+#include "bmp.h"
+
 static const std::filesystem::path INPUT_FILEPATH{ "img03.bmp" };
-static constexpr auto HEADER_SIZE{ 54U };
 static constexpr auto THREADS_PER_BLOCK{ 512U };
+static constexpr auto CHUNK_PIXELS{ 16U << 10 };
+static constexpr auto BLOCKS_PER_SM{ 4 };
 
-uint64_t proceed(const std::vector<char>& data);
+uint64_t proceed(const pixel_view& view);
 
 int main()
 {
-	std::ifstream input(INPUT_FILEPATH, std::ios::in | std::ios::binary);
-	if (!input.is_open())
+	const bmp_image image(INPUT_FILEPATH);
+	if (!image.is_open())
 	{
 		std::cerr << "Failed to open file: path=" << INPUT_FILEPATH << '\n';
 		return -1;
 	}
 
-	std::vector<char> data;
-	{
-		std::array<char, HEADER_SIZE> header;
-		input.read(header.data(), header.size());
-
-		const auto data_offset = *reinterpret_cast<uint32_t*>(&header[10]);
-		const auto width = *reinterpret_cast<uint32_t*>(&header[18]);
-		const auto height = *reinterpret_cast<uint32_t*>(&header[22]);
-		std::cout << "data_offset=" << data_offset << ", width=" << width << ", height=" << height << '\n';
-
-		data.resize(data_offset - HEADER_SIZE);
-		input.read(data.data(), data.size());
-
-		data.reserve(((width * 3 + 3) & (~3)) * height);
-
-		std::vector<char> row_padded((width * 3 + 3) & (~3));
-		for (size_t i{}; i < height; ++i)
-		{
-			input.read(row_padded.data(), row_padded.size());
-			for (size_t j{}; j < width * 3; j += 3)
-			{
-				data.push_back(row_padded[j]);
-				data.push_back(row_padded[j + 1]);
-				data.push_back(row_padded[j + 2]);
-			}
-		}
-
-		assert(data.size() % 3 == 0);
-	}
+	const auto& view = image.view();
+	std::cout << "data_offset=" << image.data_offset() << ", width=" << view.width << ", height=" << view.height << '\n';
 
-	std::cout << "8b: cnt=" << proceed(data) << '\n';
+	std::cout << "8b: cnt=" << proceed(view) << '\n';
 
 	cudaDeviceReset();
 
 	return 0;
 }
 
+// Blocks pull CHUNK_PIXELS-pixel chunks off a global counter until the image
+// is used up, so a block that is scheduled late or runs slowly just takes
+// fewer chunks. Inside a chunk consecutive threads read consecutive pixels.
 template <size_t BlockSize>
-__global__ void cuda_proceed(char* data, const size_t data_size, uint64_t* cnt)
+__global__ void cuda_proceed(const char* data, const size_t pixels, unsigned long long* next_chunk, unsigned long long* cnt)
 {
 	const auto tid = threadIdx.x;
-	const auto supply = (data_size % BlockSize) / 3;
-	const auto spl_tmp = BlockSize - 1 - tid;
-	const auto cull_data_size = data_size - supply * 3;
-	const long end = data_size - 1 - (tid + 1) * cull_data_size / BlockSize - 3 * (spl_tmp < supply ? (supply - spl_tmp) : 0);
-	const long start = data_size - 1 - tid * cull_data_size / BlockSize - 3 * (spl_tmp < supply ? (supply - spl_tmp - 1) : 0);
+	__shared__ unsigned long long chunk;
 	uint64_t local_cnt{};
-	for (long i = start; i > end; i -= 3)
-		if (static_cast<size_t>(data[i]) * data[i - 1] * data[i - 2] < 1000)
-			++local_cnt;
+
+	for (;;)
+	{
+		if (tid == 0)
+			chunk = atomicAdd(next_chunk, 1ULL);
+		__syncthreads();
+		const size_t first = chunk * CHUNK_PIXELS;
+		__syncthreads();
+		if (first >= pixels)
+			break;
+
+		const auto last = first + CHUNK_PIXELS < pixels ? first + CHUNK_PIXELS : pixels;
+		for (auto i = first + tid; i < last; i += BlockSize)
+			if (static_cast<size_t>(data[i * 3]) * data[i * 3 + 1] * data[i * 3 + 2] < 1000)
+				++local_cnt;
+	}
 
 	__shared__ uint64_t shared_cnt[BlockSize];
 	shared_cnt[tid] = local_cnt;
@@ -87,28 +71,34 @@ __global__ void cuda_proceed(char* data, const size_t data_size, uint64_t* cnt)
 	}
 
 	if (tid == 0)
-		*cnt = shared_cnt[0];
+		atomicAdd(cnt, static_cast<unsigned long long>(shared_cnt[0]));
 }
 
-uint64_t proceed(const std::vector<char>& data)
+uint64_t proceed(const pixel_view& view)
 {
+	// The pitched copy drops the row padding on the way to the device, so the
+	// kernel still sees tightly packed triplets.
 	char* dev_data;
-	cudaMalloc(&dev_data, data.size() * sizeof(char));
-	cudaMemcpy(dev_data, data.data(), data.size() * sizeof(char), cudaMemcpyHostToDevice);
+	cudaMalloc(&dev_data, view.size() * sizeof(char));
+	cudaMemcpy2D(dev_data, view.row_size(), view.data, view.stride, view.row_size(), view.height, cudaMemcpyHostToDevice);
+
+	// dev_counters[0] is the next chunk, dev_counters[1] the count.
+	unsigned long long* dev_counters;
+	cudaMalloc(&dev_counters, 2 * sizeof(unsigned long long));
+	cudaMemset(dev_counters, 0, 2 * sizeof(unsigned long long));
 
-	uint64_t* dev_cnt;
-	cudaMalloc(&dev_cnt, sizeof(uint64_t));
-	cudaMemcpy(dev_data, data.data(), data.size() * sizeof(char), cudaMemcpyHostToDevice);
+	int sm_count{ 1 };
+	cudaDeviceGetAttribute(&sm_count, cudaDevAttrMultiProcessorCount, 0);
 
 	const dim3 block_size(THREADS_PER_BLOCK, 1, 1);
-	const dim3 grid_size(1, 1, 1);
-	cuda_proceed<THREADS_PER_BLOCK> << <grid_size, block_size >> > (dev_data, data.size(), dev_cnt);
+	const dim3 grid_size(sm_count * BLOCKS_PER_SM, 1, 1);
+	cuda_proceed<THREADS_PER_BLOCK> << <grid_size, block_size >> > (dev_data, view.pixels(), dev_counters, dev_counters + 1);
 	cudaDeviceSynchronize();
 
-	size_t cnt{};
-	cudaMemcpy(&cnt, dev_cnt, sizeof(uint64_t), cudaMemcpyDeviceToHost);
+	unsigned long long cnt{};
+	cudaMemcpy(&cnt, dev_counters + 1, sizeof(cnt), cudaMemcpyDeviceToHost);
 
-	cudaFree(dev_cnt);
+	cudaFree(dev_counters);
 	cudaFree(dev_data);
 
 	return cnt;
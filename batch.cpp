@@ -0,0 +1,161 @@
+// Counts many images in one process, so a run over thousands of small files
+// pays for process start-up and thread creation once.
+//
+//   ./batch [-l list.txt] [file.bmp | dir]...
+//
+// Every image is a task on the shared pool, and 3.cpp's proceed() splits each
+// image into chunks on that same pool, so large images use all cores and
+// small ones simply run side by side. Pixel buffers come from the shared
+// buffer_arena, so they are recycled from image to image. At most
+// IMAGES_PER_THREAD images per thread are read or counted at a time, so memory
+// follows the pool size rather than the number of files. Results are printed
+// in input order, one line per file, as soon as all the files before them are
+// done.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "bmp.h"
+#include "kernel.h"
+#include "thread_pool.h"
+
+#define NO_MAIN
+namespace v3 {
+#include "3.cpp"
+}
+#undef NO_MAIN
+
+static constexpr auto IMAGES_PER_THREAD{ 2U };
+
+struct batch_result
+{
+    bool done{};
+    bool ok{};
+    size_t width{};
+    size_t height{};
+    uint64_t cnt{};
+};
+
+bool collect_paths(const std::filesystem::path& path, std::vector<std::filesystem::path>& paths);
+
+int main(int argc, char* argv[])
+{
+    std::vector<std::filesystem::path> paths;
+    for (int i{ 1 }; i < argc; ++i)
+    {
+        const std::string arg = argv[i];
+        if (arg == "-l" && i + 1 < argc)
+        {
+            std::ifstream list(argv[++i]);
+            if (!list.is_open())
+            {
+                std::cerr << "Failed to open file: path=" << argv[i] << '\n';
+                return -1;
+            }
+            for (std::string line; std::getline(list, line);)
+                if (!line.empty() && !collect_paths(line, paths))
+                    return -1;
+        }
+        else if (!collect_paths(arg, paths))
+            return -1;
+    }
+    if (paths.empty())
+    {
+        std::cerr << "Usage: " << argv[0] << " [-l list.txt] [file.bmp | dir]...\n";
+        return -1;
+    }
+
+    auto& pool = thread_pool::instance();
+    std::vector<batch_result> results(paths.size());
+    std::mutex results_mutex;
+    size_t next_print{};
+    std::atomic<size_t> failed{};
+
+    std::mutex slots_mutex;
+    std::condition_variable slot_free;
+    size_t in_flight{};
+    const auto max_in_flight = pool.size() * IMAGES_PER_THREAD;
+
+    const auto start = std::chrono::steady_clock::now();
+
+    task_group group;
+    for (size_t i{}; i < paths.size(); ++i)
+    {
+        {
+            std::unique_lock lock(slots_mutex);
+            slot_free.wait(lock, [&] { return in_flight < max_in_flight; });
+            ++in_flight;
+        }
+
+        pool.submit(group, [&, i] {
+            batch_result result{ true };
+
+            bmp_reader reader(paths[i]);
+            if (reader.is_open())
+            {
+                pixel_buffer buffer;
+                const auto view = reader.read_rows(buffer, reader.info().height);
+                if (view.height == reader.info().height)
+                    result = { true, true, view.width, view.height, v3::proceed(view, pool) };
+            }
+            if (!result.ok)
+                ++failed;
+
+            std::lock_guard _(results_mutex);
+            results[i] = result;
+            for (; next_print < results.size() && results[next_print].done; ++next_print)
+            {
+                const auto& r = results[next_print];
+                if (r.ok)
+                    std::cout << paths[next_print].string() << ": width=" << r.width << ", height=" << r.height << ", cnt=" << r.cnt << '\n';
+                else
+                    std::cout << paths[next_print].string() << ": failed\n";
+            }
+
+            std::lock_guard slot(slots_mutex);
+            --in_flight;
+            slot_free.notify_one();
+            });
+    }
+    pool.wait(group);
+
+    const auto seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cerr << "batch: files=" << paths.size() << ", failed=" << failed << ", threads=" << pool.size()
+        << ", seconds=" << seconds << ", files_per_second=" << paths.size() / seconds << '\n';
+
+    return failed ? 1 : 0;
+}
+
+// A directory contributes its .bmp files (not recursively) in name order.
+bool collect_paths(const std::filesystem::path& path, std::vector<std::filesystem::path>& paths)
+{
+    std::error_code ec;
+    if (!std::filesystem::is_directory(path, ec))
+    {
+        paths.push_back(path);
+        return true;
+    }
+
+    std::vector<std::filesystem::path> entries;
+    for (auto&& entry : std::filesystem::directory_iterator(path, ec))
+        if (entry.path().extension() == ".bmp")
+            entries.push_back(entry.path());
+    if (ec)
+    {
+        std::cerr << "Failed to list directory: path=" << path << '\n';
+        return false;
+    }
+
+    std::sort(entries.begin(), entries.end());
+    paths.insert(paths.end(), entries.begin(), entries.end());
+    return true;
+}
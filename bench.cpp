@@ -0,0 +1,302 @@
+// Times every backend's proceed() on the same in-memory pixels, across thread
+// counts and image sizes, and writes one CSV row per (backend, threads, image).
+//
+// The variants are compiled in here with NO_MAIN, each in its own namespace,
+// so their code is timed exactly as written. Everything they include must be
+// included above them first.
+//
+//   g++ -std=c++17 -O2 -fopenmp -pthread bench.cpp -o bench
+//   ./bench [-o bench.csv] [-t max_threads] [-r reps] [-p] [WxH | file.bmp]...
+//
+// -p adds perf_event counters per rep, summed over every thread of the
+// process, to each row. Events the machine does not allow are left empty;
+// what is missing and why is printed once.
+//
+// The *_numa backends scan a placed_image copy, placed once before the timing,
+// with their workers pinned by BGR_PIN, or scattered over the nodes when it is
+// not set. OpenMP keeps its threads, so 4_openmp rows of later images run on
+// threads that are still pinned.
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <numeric>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <omp.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "bmp.h"
+#include "kernel.h"
+#include "numa.h"
+#include "perf_counters.h"
+#include "placed_image.h"
+#include "reduce.h"
+#include "synth.h"
+#include "thread_pool.h"
+#include "tile_cache.h"
+
+#define NO_MAIN
+namespace v0 {
+#include "brute.cpp"
+}
+namespace v2 {
+#include "2.cpp"
+}
+namespace v3 {
+#include "3.cpp"
+}
+namespace v4 {
+#include "4.cpp"
+}
+#undef NO_MAIN
+
+static constexpr auto WARMUP_NUM{ 2U };
+static constexpr auto REPS_NUM{ 10U };
+
+using bench_clock = std::chrono::steady_clock;
+
+struct bench_image
+{
+    std::string name;
+    pixel_buffer storage;
+    std::unique_ptr<bmp_image> file;
+    pixel_view view;
+};
+
+struct backend
+{
+    std::string name;
+    bool threaded;
+    // Sets up what the backend keeps across calls (e.g. its pool) and returns
+    // the call to time.
+    std::function<std::function<uint64_t()>(const pixel_view&, size_t)> prepare;
+};
+
+bench_image make_image(size_t width, size_t height);
+std::vector<size_t> thread_counts(size_t max_threads);
+
+int main(int argc, char* argv[])
+{
+    std::filesystem::path output{ "bench.csv" };
+    size_t max_threads = std::max(1U, std::thread::hardware_concurrency());
+    size_t reps = REPS_NUM;
+    bool perf{};
+    std::vector<bench_image> images;
+
+    for (int i{ 1 }; i < argc; ++i)
+    {
+        const std::string arg = argv[i];
+        if (arg == "-o" && i + 1 < argc)
+            output = argv[++i];
+        else if (arg == "-t" && i + 1 < argc)
+            max_threads = std::max(1, std::atoi(argv[++i]));
+        else if (arg == "-r" && i + 1 < argc)
+            reps = std::max(1, std::atoi(argv[++i]));
+        else if (arg == "-p")
+            perf = true;
+        else if (const auto x = arg.find('x'); x != std::string::npos && std::filesystem::path(arg).extension() != ".bmp")
+            images.push_back(make_image(std::stoul(arg.substr(0, x)), std::stoul(arg.substr(x + 1))));
+        else
+        {
+            auto file = std::make_unique<bmp_image>(arg);
+            if (!file->is_open())
+            {
+                std::cerr << "Failed to open file: path=" << arg << '\n';
+                return -1;
+            }
+            images.push_back({ arg, {}, std::move(file), {} });
+            images.back().view = images.back().file->view();
+        }
+    }
+    if (images.empty())
+        for (auto [width, height] : { std::pair{ 641U, 480U }, { 1921U, 1080U }, { 4097U, 4096U } })
+            images.push_back(make_image(width, height));
+
+    const auto level = detect_simd_level();
+    const auto numa_pin = default_pin_policy() != pin_policy::none ? default_pin_policy() : pin_policy::scatter;
+    const std::vector<backend> backends{
+        { "brute", false, [](const pixel_view& view, size_t) {
+            return [&view] { return v0::proceed(view); }; } },
+        { "kernel_scalar", false, [](const pixel_view& view, size_t) {
+            return [&view] { return count_product_below(simd_level::scalar, view); }; } },
+        { "kernel_" + std::string(simd_level_name(level)), false, [level](const pixel_view& view, size_t) {
+            return [&view, level] { return count_product_below(level, view); }; } },
+        { "2_pthread", true, [](const pixel_view& view, size_t threads) {
+            auto team = std::make_shared<v2::pthread_team>(threads);
+            return [&view, team] { return v2::proceed(view, *team); }; } },
+        { "3_pool", true, [](const pixel_view& view, size_t threads) {
+            auto pool = std::make_shared<thread_pool>(threads);
+            return [&view, pool] { return v3::proceed(view, *pool); }; } },
+        // Against 3_pool: an image whose tiles are all cached, through the
+        // cache and as tile_cache_mode::automatic decides.
+        { "tile_cache_warm", true, [](const pixel_view& view, size_t threads) {
+            auto pool = std::make_shared<thread_pool>(threads);
+            auto cache = std::make_shared<tile_cache>();
+            count_incremental(view, *cache, 1000, *pool, nullptr, tile_cache_mode::always);
+            return [&view, pool, cache] { return count_incremental(view, *cache, 1000, *pool, nullptr, tile_cache_mode::always); }; } },
+        { "tile_cache_auto", true, [](const pixel_view& view, size_t threads) {
+            auto pool = std::make_shared<thread_pool>(threads);
+            auto cache = std::make_shared<tile_cache>();
+            count_incremental(view, *cache, 1000, *pool, nullptr, tile_cache_mode::always);
+            return [&view, pool, cache] { return count_incremental(view, *cache, 1000, *pool); }; } },
+        { "4_openmp", true, [](const pixel_view& view, size_t threads) {
+            return [&view, threads] { return v4::proceed(view, static_cast<int>(threads)); }; } },
+        { "3_pool_numa", true, [numa_pin](const pixel_view& view, size_t threads) {
+            auto pool = std::make_shared<thread_pool>(threads, numa_pin);
+            auto placed = std::make_shared<placed_image>(view, thread_policy{ pool.get() });
+            return [pool, placed] { return v3::proceed_placed(placed->view(), *pool); }; } },
+        { "4_openmp_numa", true, [numa_pin](const pixel_view& view, size_t threads) {
+            auto placed = std::make_shared<placed_image>(view, openmp_policy{ static_cast<int>(threads) }, numa_pin);
+            return [placed, threads, numa_pin] { return v4::proceed(placed->view(), static_cast<int>(threads), numa_pin); }; } },
+        { "reduce_threads", true, [](const pixel_view& view, size_t threads) {
+            auto pool = std::make_shared<thread_pool>(threads);
+            return [&view, pool] { return reduce_pixels<product_below, count_reduction>(view, thread_policy{ pool.get() }).value; }; } },
+        { "reduce_openmp", true, [](const pixel_view& view, size_t threads) {
+            return [&view, threads] { return reduce_pixels<product_below, count_reduction>(view, openmp_policy{ static_cast<int>(threads) }).value; }; } },
+        // The count, channel histograms and moments, as three passes and as one.
+        { "3q_separate_threads", true, [](const pixel_view& view, size_t threads) {
+            auto pool = std::make_shared<thread_pool>(threads);
+            return [&view, pool] {
+                const thread_policy policy{ pool.get() };
+                const auto cnt = reduce_pixels<product_below, count_reduction>(view, policy).value;
+                reduce_pixels<any_pixel, histogram_reduction>(view, policy);
+                reduce_pixels<any_pixel, moments_reduction>(view, policy);
+                return cnt; }; } },
+        { "3q_fused_threads", true, [](const pixel_view& view, size_t threads) {
+            auto pool = std::make_shared<thread_pool>(threads);
+            return [&view, pool] {
+                const auto results = reduce_fused(view, thread_policy{ pool.get() }, query<product_below, count_reduction>{},
+                    query<any_pixel, histogram_reduction>{}, query<any_pixel, moments_reduction>{});
+                return std::get<0>(results).value; }; } },
+    };
+
+    std::ofstream csv(output);
+    if (!csv.is_open())
+    {
+        std::cerr << "Failed to open file: path=" << output << '\n';
+        return -1;
+    }
+    csv << "backend,threads,image,width,height,bytes,reps,median_ms,p99_ms,gbps,cnt";
+    if (perf)
+    {
+        for (size_t e{}; e < PERF_EVENTS_NUM; ++e)
+            csv << ',' << perf_event_name(e);
+        csv << ",ipc,llc_est_gbps";
+    }
+    csv << '\n';
+    bool perf_described{};
+
+    for (auto&& image : images)
+    {
+        const auto& view = image.view;
+        const auto expected = v0::proceed(view);
+
+        for (auto&& b : backends)
+            for (auto threads : b.threaded ? thread_counts(max_threads) : std::vector<size_t>{ 1 })
+            {
+                const auto run = b.prepare(view, threads);
+
+                uint64_t cnt{};
+                for (size_t i{}; i < WARMUP_NUM; ++i)
+                    cnt = run();
+
+                // Opened after the warm-up, so that every thread the backend
+                // keeps is already there.
+                std::unique_ptr<process_perf_counters> counters;
+                perf_values before;
+                if (perf)
+                {
+                    counters = std::make_unique<process_perf_counters>();
+                    before = counters->read();
+                }
+
+                std::vector<double> ms(reps);
+                for (auto&& t : ms)
+                {
+                    const auto start = bench_clock::now();
+                    cnt = run();
+                    t = std::chrono::duration<double, std::milli>(bench_clock::now() - start).count();
+                }
+                std::sort(ms.begin(), ms.end());
+
+                perf_values events;
+                if (counters)
+                {
+                    events = counters->read() - before;
+                    if (!perf_described)
+                        std::cerr << "perf: " << counters->describe() << '\n';
+                    perf_described = true;
+                }
+
+                const auto median = ms[ms.size() / 2];
+                const auto p99 = ms[std::min(ms.size() - 1, ms.size() * 99 / 100)];
+                csv << b.name << ',' << threads << ',' << image.name << ',' << view.width << ',' << view.height << ','
+                    << view.size() << ',' << reps << ',' << median << ',' << p99 << ',' << view.size() / median / 1e6 << ',' << cnt;
+                if (perf)
+                {
+                    // Per rep; the bandwidth estimate is over the mean rep time.
+                    const auto total_ms = std::accumulate(ms.begin(), ms.end(), 0.0);
+                    for (size_t e{}; e < PERF_EVENTS_NUM; ++e)
+                        if (events.has(e))
+                            csv << ',' << events.value[e] / reps;
+                        else
+                            csv << ',';
+                    csv << ',';
+                    if (events.has(perf_cycles) && events.has(perf_instructions) && events.value[perf_cycles])
+                        csv << static_cast<double>(events.value[perf_instructions]) / events.value[perf_cycles];
+                    csv << ',';
+                    if (events.has(perf_llc_misses))
+                        csv << events.value[perf_llc_misses] * PERF_CACHE_LINE / total_ms / 1e6;
+                }
+                csv << '\n';
+
+                if (cnt != expected)
+                    std::cerr << "Count mismatch: backend=" << b.name << " threads=" << threads << " image=" << image.name
+                    << " cnt=" << cnt << " expected=" << expected << '\n';
+            }
+    }
+
+    std::cout << "Results written: path=" << output << '\n';
+
+    return 0;
+}
+
+// Random pixels with padded rows, so the stride handling is exercised too.
+bench_image make_image(size_t width, size_t height)
+{
+    bench_image image;
+    image.name = std::to_string(width) + "x" + std::to_string(height);
+    image.storage = pixel_buffer(bmp_row_stride(width) * height);
+
+    image.view = { image.storage.data(), width, height, bmp_row_stride(width) };
+
+    const synth_params params{ pixel_dist::uniform, 0, width * 31 + height };
+    for (size_t y{}; y < height; ++y)
+        synth_row(params, y, image.storage.data() + y * image.view.stride, width, image.view.stride);
+
+    return image;
+}
+
+std::vector<size_t> thread_counts(size_t max_threads)
+{
+    std::vector<size_t> counts;
+    for (size_t threads{ 1 }; threads < max_threads; threads *= 2)
+        counts.push_back(threads);
+    counts.push_back(max_threads);
+    return counts;
+}
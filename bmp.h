@@ -0,0 +1,284 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <utility>
+#include <vector>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "metrics.h"
+#include "pixel_buffer.h"
+
+static constexpr auto BMP_HEADER_SIZE{ 54U };
+
+// Read-only window over 24-bit pixel rows. Rows are `stride` bytes apart and
+// only the first `width * 3` bytes of each row are pixels, the rest is padding.
+struct pixel_view
+{
+    const char* data{};
+    size_t width{};
+    size_t height{};
+    size_t stride{};
+
+    const char* row(size_t i) const { return data + i * stride; }
+    size_t row_size() const { return width * 3; }
+    size_t pixels() const { return width * height; }
+    size_t size() const { return pixels() * 3; }
+
+    pixel_view rows(size_t first, size_t count) const { return { row(first), width, count, stride }; }
+};
+
+// View over tightly packed BGR triplets, e.g. a slice received from a socket.
+inline pixel_view packed_view(const char* data, size_t size)
+{
+    return { data, size / 3, 1, size / 3 * 3 };
+}
+
+inline size_t bmp_row_stride(size_t width)
+{
+    return (width * 3 + 3) & ~size_t{ 3 };
+}
+
+template <typename T>
+T bmp_field(const char* header, size_t offset)
+{
+    T value;
+    std::memcpy(&value, header + offset, sizeof(value));
+    return value;
+}
+
+struct bmp_info
+{
+    uint32_t data_offset{};
+    size_t width{};
+    size_t height{};
+    size_t stride{};
+};
+
+// Accepts only uncompressed 24-bit images. A negative height means top-down
+// rows; the order does not matter to any of the reductions, so both layouts
+// are exposed as stored.
+inline bool parse_bmp_header(const char* header, bmp_info& info)
+{
+    if (header[0] != 'B' || header[1] != 'M')
+        return false;
+    if (bmp_field<uint16_t>(header, 28) != 24 || bmp_field<uint32_t>(header, 30) != 0)
+        return false;
+
+    const auto width = bmp_field<int32_t>(header, 18);
+    const auto height = bmp_field<int32_t>(header, 22);
+    if (width <= 0 || height == 0)
+        return false;
+
+    info.data_offset = bmp_field<uint32_t>(header, 10);
+    info.width = width;
+    info.height = height < 0 ? -static_cast<int64_t>(height) : height;
+    info.stride = bmp_row_stride(info.width);
+
+    return info.data_offset >= BMP_HEADER_SIZE;
+}
+
+// Fills a BMP_HEADER_SIZE header for bottom-up 24-bit pixels stored right
+// after it. The 32-bit size fields are left 0 when the image outgrows them,
+// which BI_RGB readers accept.
+inline void make_bmp_header(char* header, size_t width, size_t height)
+{
+    const auto put = [header](size_t offset, auto value) { std::memcpy(header + offset, &value, sizeof(value)); };
+    const uint64_t image_size = bmp_row_stride(width) * height;
+    const uint64_t file_size = BMP_HEADER_SIZE + image_size;
+
+    std::memset(header, 0, BMP_HEADER_SIZE);
+    header[0] = 'B';
+    header[1] = 'M';
+    put(2, static_cast<uint32_t>(file_size <= UINT32_MAX ? file_size : 0));
+    put(10, static_cast<uint32_t>(BMP_HEADER_SIZE));
+    put(14, uint32_t{ 40 });
+    put(18, static_cast<int32_t>(width));
+    put(22, static_cast<int32_t>(height));
+    put(26, uint16_t{ 1 });
+    put(28, uint16_t{ 24 });
+    put(34, static_cast<uint32_t>(image_size <= UINT32_MAX ? image_size : 0));
+    put(38, int32_t{ 2835 });
+    put(42, int32_t{ 2835 });
+}
+
+// Maps a 24-bit uncompressed BMP file into memory. Pixels are used in place,
+// straight from the mapped pages; nothing is decoded or copied.
+class bmp_image
+{
+public:
+    explicit bmp_image(const std::filesystem::path& path)
+    {
+        phase_span span("load");
+        if (!map(path))
+            unmap();
+        span.add_bytes(m_size);
+    }
+
+    bmp_image(bmp_image&& other) noexcept { swap(other); }
+    bmp_image& operator=(bmp_image&& other) noexcept { swap(other); return *this; }
+    bmp_image(const bmp_image&) = delete;
+    bmp_image& operator=(const bmp_image&) = delete;
+
+    ~bmp_image() { unmap(); }
+
+    bool is_open() const { return m_base != nullptr; }
+    const pixel_view& view() const { return m_view; }
+    uint32_t data_offset() const { return m_data_offset; }
+
+    // Whole mapping, header included.
+    const char* file_data() const { return m_base; }
+    size_t file_size() const { return m_size; }
+
+private:
+    bool map(const std::filesystem::path& path)
+    {
+#ifdef _WIN32
+        m_file = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (m_file == INVALID_HANDLE_VALUE)
+            return false;
+
+        LARGE_INTEGER size;
+        if (!GetFileSizeEx(m_file, &size) || size.QuadPart < BMP_HEADER_SIZE)
+            return false;
+        m_size = static_cast<size_t>(size.QuadPart);
+
+        m_mapping = CreateFileMappingW(m_file, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (!m_mapping)
+            return false;
+
+        m_base = static_cast<const char*>(MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0));
+        if (!m_base)
+            return false;
+#else
+        m_fd = open(path.c_str(), O_RDONLY);
+        if (m_fd < 0)
+            return false;
+
+        struct stat st;
+        if (fstat(m_fd, &st) != 0 || static_cast<size_t>(st.st_size) < BMP_HEADER_SIZE)
+            return false;
+        m_size = st.st_size;
+
+        auto* addr = mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, m_fd, 0);
+        if (addr == MAP_FAILED)
+            return false;
+        m_base = static_cast<const char*>(addr);
+        madvise(addr, m_size, MADV_WILLNEED);
+#endif
+        return parse_header();
+    }
+
+    bool parse_header()
+    {
+        bmp_info info;
+        if (!parse_bmp_header(m_base, info))
+            return false;
+
+        m_data_offset = info.data_offset;
+        m_view = { m_base + info.data_offset, info.width, info.height, info.stride };
+
+        return m_data_offset + m_view.stride * (m_view.height - 1) + m_view.row_size() <= m_size;
+    }
+
+    void unmap()
+    {
+#ifdef _WIN32
+        if (m_base)
+            UnmapViewOfFile(m_base);
+        if (m_mapping)
+            CloseHandle(m_mapping);
+        if (m_file != INVALID_HANDLE_VALUE)
+            CloseHandle(m_file);
+        m_mapping = NULL;
+        m_file = INVALID_HANDLE_VALUE;
+#else
+        if (m_base)
+            munmap(const_cast<char*>(m_base), m_size);
+        if (m_fd >= 0)
+            close(m_fd);
+        m_fd = -1;
+#endif
+        m_base = nullptr;
+        m_size = 0;
+        m_view = {};
+    }
+
+    void swap(bmp_image& other) noexcept
+    {
+#ifdef _WIN32
+        std::swap(m_file, other.m_file);
+        std::swap(m_mapping, other.m_mapping);
+#else
+        std::swap(m_fd, other.m_fd);
+#endif
+        std::swap(m_base, other.m_base);
+        std::swap(m_size, other.m_size);
+        std::swap(m_data_offset, other.m_data_offset);
+        std::swap(m_view, other.m_view);
+    }
+
+#ifdef _WIN32
+    HANDLE m_file{ INVALID_HANDLE_VALUE };
+    HANDLE m_mapping{ NULL };
+#else
+    int m_fd{ -1 };
+#endif
+    const char* m_base{};
+    size_t m_size{};
+    uint32_t m_data_offset{};
+    pixel_view m_view{};
+};
+
+// Reads the pixel rows of a BMP sequentially in bands, for callers that want to
+// bound memory to a few bands instead of holding the whole image.
+class bmp_reader
+{
+public:
+    explicit bmp_reader(const std::filesystem::path& path)
+        : m_input(path, std::ios::in | std::ios::binary)
+    {
+        char header[BMP_HEADER_SIZE];
+        if (!m_input.read(header, sizeof(header)) || !parse_bmp_header(header, m_info))
+            m_input.close();
+        else
+            m_input.seekg(m_info.data_offset);
+    }
+
+    bool is_open() const { return m_input.is_open(); }
+    const bmp_info& info() const { return m_info; }
+
+    // Reads up to `rows` following rows into `buffer` and returns a view over
+    // them; the view is empty once every row has been read.
+    pixel_view read_rows(pixel_buffer& buffer, size_t rows)
+    {
+        phase_span span("read");
+        rows = std::min(rows, m_info.height - m_next_row);
+        buffer.resize(rows * m_info.stride);
+        if (!m_input.read(buffer.data(), buffer.size()))
+            rows = m_input.gcount() / m_info.stride;
+
+        m_next_row += rows;
+        span.add_bytes(rows * m_info.stride);
+        return { buffer.data(), m_info.width, rows, m_info.stride };
+    }
+
+private:
+    std::ifstream m_input;
+    bmp_info m_info{};
+    size_t m_next_row{};
+};
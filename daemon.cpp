@@ -0,0 +1,437 @@
+// Answers count queries over a Unix domain socket from one long-running
+// process, so an interactive tool asking many questions about the same images
+// pays for reading them and starting threads once.
+//
+//   ./daemon [-S socket] [-n max_images] [-m max_mib]
+//   ./daemon ask [-S socket] request...
+//
+// Requests and replies are single text lines:
+//
+//   count [-t threshold] path   ok cnt=N width=W height=H cached=0|1 us=T
+//   rect [-t threshold] x0 y0 x1 y1 path
+//                               the same, counting only [x0, x1) x [y0, y1)
+//   stats                       ok images=N bytes=B hits=H misses=M
+//   shutdown                    ok
+//
+// and anything that fails is answered with "error <reason>". Relative paths
+// are resolved against the daemon's working directory.
+//
+// Images stay mapped in an LRU cache keyed by absolute path. An entry is used
+// only while the file's mtime and size still match, so an image rewritten in
+// place is mapped again on its next query. Counts run on one warm pool through
+// 3.cpp's proceed(), and each image remembers the counts already asked for,
+// so a repeated question is a lookup. The first threshold other than the
+// default builds the image's threshold_histogram in one scan, which answers
+// every threshold after it. The first rectangle asked of an image
+// builds its region_index on the pool; every rectangle after that is O(1).
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <filesystem>
+#include <iostream>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "bmp.h"
+#include "kernel.h"
+#include "region_index.h"
+#include "thread_pool.h"
+#include "threshold_histogram.h"
+
+#define NO_MAIN
+namespace v3 {
+#include "3.cpp"
+}
+#undef NO_MAIN
+
+static constexpr auto SOCKET_PATH{ "/tmp/bgr_daemon.sock" };
+static constexpr auto MAX_IMAGES{ 16U };
+static constexpr auto MAX_MIB{ 1024U };
+static constexpr auto DEFAULT_THRESHOLD{ 1000U };
+static constexpr auto MAX_REQUEST_SIZE{ 4096U };
+
+using daemon_clock = std::chrono::steady_clock;
+
+// Mapped images, most recently used first. The cache holds at most
+// `max_images` images and `max_bytes` of mappings and region indexes, but
+// always keeps the one just asked for, however large.
+class image_cache
+{
+public:
+    struct entry
+    {
+        std::string path;
+        struct timespec mtime{};
+        off_t size{};
+        bmp_image image;
+        std::unordered_map<uint32_t, uint64_t> counts;
+        std::unordered_map<uint32_t, region_index> regions;
+        std::unique_ptr<threshold_histogram> histogram;
+        size_t extra_bytes{};
+    };
+
+    image_cache(size_t max_images, size_t max_bytes)
+        : m_max_images(max_images), m_max_bytes(max_bytes)
+    {
+    }
+
+    // Returns the entry for `path`, mapping it if it is not cached or has
+    // changed on disk, or nullptr if it cannot be opened.
+    entry* get(const std::filesystem::path& file, bool& cached)
+    {
+        std::error_code ec;
+        const auto path = std::filesystem::absolute(file, ec).lexically_normal().string();
+        struct stat st;
+        if (stat(path.c_str(), &st) != 0)
+            return nullptr;
+
+        if (const auto it = m_index.find(path); it != m_index.end())
+        {
+            const auto& e = *it->second;
+            if (e.size == st.st_size && e.mtime.tv_sec == st.st_mtim.tv_sec && e.mtime.tv_nsec == st.st_mtim.tv_nsec)
+            {
+                m_entries.splice(m_entries.begin(), m_entries, it->second);
+                ++m_hits;
+                cached = true;
+                return &m_entries.front();
+            }
+            erase(it->second);
+        }
+
+        ++m_misses;
+        cached = false;
+        bmp_image image(path);
+        if (!image.is_open())
+            return nullptr;
+
+        m_entries.push_front({ path, st.st_mtim, st.st_size, std::move(image), {}, {}, {}, 0 });
+        m_index[path] = m_entries.begin();
+        m_bytes += m_entries.front().image.file_size();
+        trim();
+
+        return &m_entries.front();
+    }
+
+    // Accounts for memory the most recently used entry has grown by.
+    void charge(entry& e, size_t bytes)
+    {
+        e.extra_bytes += bytes;
+        m_bytes += bytes;
+        trim();
+    }
+
+    size_t images() const { return m_entries.size(); }
+    size_t bytes() const { return m_bytes; }
+    size_t hits() const { return m_hits; }
+    size_t misses() const { return m_misses; }
+
+private:
+    void trim()
+    {
+        while (m_entries.size() > 1 && (m_entries.size() > m_max_images || m_bytes > m_max_bytes))
+            erase(std::prev(m_entries.end()));
+    }
+
+    void erase(std::list<entry>::iterator it)
+    {
+        m_bytes -= it->image.file_size() + it->extra_bytes;
+        m_index.erase(it->path);
+        m_entries.erase(it);
+    }
+
+    size_t m_max_images;
+    size_t m_max_bytes;
+    size_t m_bytes{};
+    size_t m_hits{};
+    size_t m_misses{};
+    std::list<entry> m_entries;
+    std::unordered_map<std::string, std::list<entry>::iterator> m_index;
+};
+
+struct daemon_client
+{
+    int sock{ -1 };
+    std::string input;
+};
+
+int serve(const std::string& socket_path, size_t max_images, size_t max_bytes);
+int ask(const std::string& socket_path, const std::vector<std::string>& requests);
+std::string answer(const std::string& request, image_cache& cache, thread_pool& pool, bool& shutdown);
+bool make_address(const std::string& socket_path, sockaddr_un& addr);
+
+int main(int argc, char* argv[])
+{
+    const bool asking = argc >= 2 && std::string(argv[1]) == "ask";
+    std::string socket_path{ SOCKET_PATH };
+    size_t max_images = MAX_IMAGES;
+    size_t max_mib = MAX_MIB;
+    std::vector<std::string> requests;
+
+    for (int i{ asking ? 2 : 1 }; i < argc; ++i)
+    {
+        const std::string arg = argv[i];
+        if (arg == "-S" && i + 1 < argc)
+            socket_path = argv[++i];
+        else if (!asking && arg == "-n" && i + 1 < argc)
+            max_images = std::max(1, std::atoi(argv[++i]));
+        else if (!asking && arg == "-m" && i + 1 < argc)
+            max_mib = std::max(1, std::atoi(argv[++i]));
+        else if (asking)
+            requests.push_back(arg);
+        else
+        {
+            std::cerr << "Usage: " << argv[0] << " [-S socket] [-n max_images] [-m max_mib]\n"
+                << "       " << argv[0] << " ask [-S socket] request...\n";
+            return -1;
+        }
+    }
+
+    return asking ? ask(socket_path, requests) : serve(socket_path, max_images, max_mib << 20);
+}
+
+// One thread serves every client in turn; the time goes into the counts,
+// which the pool spreads over all cores.
+int serve(const std::string& socket_path, size_t max_images, size_t max_bytes)
+{
+    sockaddr_un addr;
+    if (!make_address(socket_path, addr))
+    {
+        std::cerr << "Socket path too long: path=" << socket_path << '\n';
+        return -1;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+
+    const auto listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(socket_path.c_str());
+    if (listener < 0 || bind(listener, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 || listen(listener, SOMAXCONN) != 0)
+    {
+        std::cerr << "Failed to listen: path=" << socket_path << " errno=" << errno << '\n';
+        return -1;
+    }
+
+    auto& pool = thread_pool::instance();
+    image_cache cache(max_images, max_bytes);
+    std::vector<daemon_client> clients;
+    std::cout << "daemon: listening path=" << socket_path << ", threads=" << pool.size() << std::endl;
+
+    for (bool shutdown{}; !shutdown;)
+    {
+        std::vector<pollfd> fds{ { listener, POLLIN, 0 } };
+        for (auto&& c : clients)
+            fds.push_back({ c.sock, POLLIN, 0 });
+
+        if (poll(fds.data(), fds.size(), -1) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            std::cerr << "daemon: poll failed errno=" << errno << '\n';
+            break;
+        }
+
+        for (size_t i{ 1 }; i < fds.size(); ++i)
+        {
+            auto& c = clients[i - 1];
+            if (!fds[i].revents)
+                continue;
+
+            char buffer[MAX_REQUEST_SIZE];
+            const auto received = read(c.sock, buffer, sizeof(buffer));
+            if (received <= 0)
+            {
+                close(c.sock);
+                c.sock = -1;
+                continue;
+            }
+            c.input.append(buffer, received);
+
+            for (size_t eol; (eol = c.input.find('\n')) != std::string::npos;)
+            {
+                auto reply = answer(c.input.substr(0, eol), cache, pool, shutdown) + '\n';
+                c.input.erase(0, eol + 1);
+                if (send(c.sock, reply.data(), reply.size(), 0) != static_cast<ssize_t>(reply.size()))
+                    break;
+            }
+            if (c.input.size() > MAX_REQUEST_SIZE)
+            {
+                close(c.sock);
+                c.sock = -1;
+            }
+        }
+        clients.erase(std::remove_if(clients.begin(), clients.end(), [](const daemon_client& c) { return c.sock < 0; }), clients.end());
+
+        if (fds[0].revents & POLLIN)
+            if (const auto sock = accept(listener, nullptr, nullptr); sock >= 0)
+                clients.push_back({ sock, {} });
+    }
+
+    for (auto&& c : clients)
+        close(c.sock);
+    close(listener);
+    unlink(socket_path.c_str());
+    std::cout << "daemon: stopped\n";
+
+    return 0;
+}
+
+std::string answer(const std::string& request, image_cache& cache, thread_pool& pool, bool& shutdown)
+{
+    const auto start = daemon_clock::now();
+    std::istringstream in(request);
+    std::string command;
+    in >> command;
+
+    if (command == "stats")
+        return "ok images=" + std::to_string(cache.images()) + " bytes=" + std::to_string(cache.bytes())
+        + " hits=" + std::to_string(cache.hits()) + " misses=" + std::to_string(cache.misses());
+    if (command == "shutdown")
+    {
+        shutdown = true;
+        return "ok";
+    }
+    if (command != "count" && command != "rect")
+        return "error unknown request";
+
+    uint32_t threshold = DEFAULT_THRESHOLD;
+    size_t x0{}, y0{}, x1{}, y1{};
+    std::string path;
+    in >> std::ws;
+    if (in.peek() == '-')
+    {
+        // Read signed, since an unsigned read takes "-1" as 4294967295.
+        std::string flag;
+        int64_t value{};
+        if (!(in >> flag >> value) || flag != "-t" || value < 0 || value > UINT32_MAX)
+            return "error bad threshold";
+        threshold = static_cast<uint32_t>(value);
+    }
+    if (command == "rect" && !(in >> x0 >> y0 >> x1 >> y1))
+        return "error bad rectangle";
+    in >> std::ws;
+    std::getline(in, path);
+    if (path.empty())
+        return "error missing path";
+
+    bool cached{};
+    auto* entry = cache.get(path, cached);
+    if (!entry)
+        return "error cannot open " + path;
+
+    const auto& view = entry->image.view();
+    if (command == "rect")
+    {
+        auto& index = entry->regions[threshold];
+        if (!index.is_built())
+        {
+            if (!index.build(view, threshold, thread_policy{ &pool }))
+            {
+                entry->regions.erase(threshold);
+                return "error image too large for a region index";
+            }
+            cache.charge(*entry, index.bytes());
+        }
+
+        const auto cnt = index.count(x0, y0, x1, y1);
+        const auto us = std::chrono::duration_cast<std::chrono::microseconds>(daemon_clock::now() - start).count();
+        return "ok cnt=" + std::to_string(cnt) + " width=" + std::to_string(view.width) + " height=" + std::to_string(view.height)
+            + " cached=" + std::to_string(cached) + " us=" + std::to_string(us);
+    }
+
+    auto it = entry->counts.find(threshold);
+    if (it == entry->counts.end())
+    {
+        uint64_t cnt{};
+        if (threshold != DEFAULT_THRESHOLD && !entry->histogram)
+        {
+            entry->histogram = std::make_unique<threshold_histogram>();
+            entry->histogram->add(view, thread_policy{ &pool });
+            cache.charge(*entry, 2 * HIST_BINS * sizeof(uint64_t));
+        }
+
+        if (threshold == DEFAULT_THRESHOLD)
+            cnt = v3::proceed(view, pool);
+        else if (!entry->histogram->count_below(threshold, cnt))
+        {
+            std::atomic<uint64_t> below{};
+            const auto chunk_rows = std::max<size_t>(1, v3::CHUNK_SIZE / view.stride);
+            pool.parallel_for(0, view.height, chunk_rows, [&view, &below, threshold](size_t first, size_t last) {
+                below.fetch_add(count_product_below(view.rows(first, last - first), threshold), std::memory_order_relaxed);
+                });
+            cnt = below;
+        }
+        it = entry->counts.emplace(threshold, cnt).first;
+    }
+
+    const auto us = std::chrono::duration_cast<std::chrono::microseconds>(daemon_clock::now() - start).count();
+    return "ok cnt=" + std::to_string(it->second) + " width=" + std::to_string(view.width) + " height=" + std::to_string(view.height)
+        + " cached=" + std::to_string(cached) + " us=" + std::to_string(us);
+}
+
+// Sends every request on one connection and prints each reply.
+int ask(const std::string& socket_path, const std::vector<std::string>& requests)
+{
+    sockaddr_un addr;
+    const auto sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (!make_address(socket_path, addr) || sock < 0 || connect(sock, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0)
+    {
+        std::cerr << "Failed to connect: path=" << socket_path << '\n';
+        return -1;
+    }
+
+    int failed{};
+    std::string input;
+    for (auto&& request : requests)
+    {
+        const auto line = request + '\n';
+        if (send(sock, line.data(), line.size(), 0) != static_cast<ssize_t>(line.size()))
+            break;
+
+        size_t eol;
+        while ((eol = input.find('\n')) == std::string::npos)
+        {
+            char buffer[MAX_REQUEST_SIZE];
+            const auto received = read(sock, buffer, sizeof(buffer));
+            if (received <= 0)
+            {
+                std::cerr << "Connection closed: path=" << socket_path << '\n';
+                close(sock);
+                return -1;
+            }
+            input.append(buffer, received);
+        }
+
+        const auto reply = input.substr(0, eol);
+        input.erase(0, eol + 1);
+        std::cout << reply << '\n';
+        failed |= reply.compare(0, 3, "ok ") != 0 && reply != "ok";
+    }
+    close(sock);
+
+    return failed;
+}
+
+bool make_address(const std::string& socket_path, sockaddr_un& addr)
+{
+    addr = {};
+    addr.sun_family = AF_UNIX;
+    if (socket_path.size() >= sizeof(addr.sun_path))
+        return false;
+    std::memcpy(addr.sun_path, socket_path.c_str(), socket_path.size() + 1);
+    return true;
+}
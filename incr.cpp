@@ -0,0 +1,88 @@
+// Counts images through a persistent tile cache, so a new version of an image
+// that changed in a small region only has that region recounted.
+//
+//   ./incr [-c tiles.cache] [-t threshold] [-m auto|always|never] file.bmp...
+//
+// The cache file is read before the first image and written back after the
+// last one; the images of one run share it too. -m auto, the default, counts
+// directly when the cache cannot beat that on this machine; `always` and
+// `never` force one path, e.g. to compare their times.
+
+#include <chrono>
+#include <filesystem>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "bmp.h"
+#include "kernel.h"
+#include "thread_pool.h"
+#include "tile_cache.h"
+
+static const std::filesystem::path CACHE_FILEPATH{ "tiles.cache" };
+static constexpr auto DEFAULT_THRESHOLD{ 1000U };
+
+int main(int argc, char* argv[])
+{
+    std::filesystem::path cache_path{ CACHE_FILEPATH };
+    uint32_t threshold = DEFAULT_THRESHOLD;
+    auto mode = tile_cache_mode::automatic;
+    std::vector<std::filesystem::path> paths;
+
+    for (int i{ 1 }; i < argc; ++i)
+    {
+        const std::string arg = argv[i];
+        if (arg == "-c" && i + 1 < argc)
+            cache_path = argv[++i];
+        else if (arg == "-t" && i + 1 < argc)
+            threshold = static_cast<uint32_t>(std::stoul(argv[++i]));
+        else if (arg == "-m" && i + 1 < argc && parse_tile_cache_mode(argv[i + 1], mode))
+            ++i;
+        else
+            paths.push_back(arg);
+    }
+    if (paths.empty())
+    {
+        std::cerr << "Usage: " << argv[0] << " [-c tiles.cache] [-t threshold] [-m auto|always|never] file.bmp...\n";
+        return -1;
+    }
+
+    tile_cache cache;
+    if (!cache.load(cache_path))
+    {
+        std::cerr << "Ignoring damaged cache: path=" << cache_path << '\n';
+        cache = tile_cache();
+    }
+
+    int failed{};
+    for (auto&& path : paths)
+    {
+        const bmp_image image(path);
+        if (!image.is_open())
+        {
+            std::cerr << "Failed to open file: path=" << path << '\n';
+            failed = 1;
+            continue;
+        }
+
+        const auto start = std::chrono::steady_clock::now();
+        tile_stats stats;
+        const auto cnt = count_incremental(image.view(), cache, threshold, thread_pool::instance(), &stats, mode);
+        const auto ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+        std::cout << path.string() << ": cnt=" << cnt;
+        if (stats.direct)
+            std::cout << ", direct";
+        else
+            std::cout << ", tiles=" << stats.tiles << ", recounted=" << stats.recounted;
+        std::cout << ", ms=" << ms << '\n';
+    }
+
+    if (!cache.save(cache_path))
+    {
+        std::cerr << "Failed to write cache: path=" << cache_path << '\n';
+        return -1;
+    }
+
+    return failed;
+}
@@ -0,0 +1,202 @@
+#pragma once
+
+#include <cstdint>
+
+#include "bmp.h"
+
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define KERNEL_X86 1
+#include <immintrin.h>
+#endif
+
+// Counts pixels whose channel product is below `threshold`, exactly as the
+// original `static_cast<size_t>(data[i]) * data[i + 1] * data[i + 2] < 1000`:
+// channels are signed chars and the product wraps modulo 2^64, so a pixel
+// matches iff 0 <= b * g * r < threshold.
+
+enum class simd_level { scalar, sse41, avx2 };
+
+inline const char* simd_level_name(simd_level level)
+{
+    switch (level)
+    {
+    case simd_level::sse41: return "sse4.1";
+    case simd_level::avx2: return "avx2";
+    default: return "scalar";
+    }
+}
+
+inline uint64_t count_product_below_scalar(const char* data, size_t pixels, uint32_t threshold)
+{
+    uint64_t cnt{};
+    for (size_t i{}; i < pixels * 3; i += 3)
+        if (static_cast<size_t>(data[i]) * data[i + 1] * data[i + 2] < threshold)
+            ++cnt;
+
+    return cnt;
+}
+
+#ifdef KERNEL_X86
+namespace kernel_detail
+{
+    // pshufb masks gathering channel c of 16 interleaved pixels out of the
+    // k-th 16-byte chunk; lanes owned by other chunks are zeroed (-128).
+    struct deinterleave_table
+    {
+        alignas(16) int8_t mask[3][3][16]{};
+
+        constexpr deinterleave_table()
+        {
+            for (int c = 0; c < 3; ++c)
+                for (int k = 0; k < 3; ++k)
+                    for (int j = 0; j < 16; ++j)
+                    {
+                        const int src = 3 * j + c - 16 * k;
+                        mask[c][k][j] = static_cast<int8_t>(src >= 0 && src < 16 ? src : -128);
+                    }
+        }
+    };
+
+    inline constexpr deinterleave_table DEINTERLEAVE{};
+
+    __attribute__((target("sse4.1")))
+    inline __m128i channel(__m128i a, __m128i b, __m128i c, int ch)
+    {
+        const auto* mask = reinterpret_cast<const __m128i*>(DEINTERLEAVE.mask[ch]);
+        return _mm_or_si128(_mm_or_si128(
+            _mm_shuffle_epi8(a, _mm_load_si128(mask)),
+            _mm_shuffle_epi8(b, _mm_load_si128(mask + 1))),
+            _mm_shuffle_epi8(c, _mm_load_si128(mask + 2)));
+    }
+
+    // |b * g| <= 2^14 fits in 16 bits; the full product is split into its
+    // signed high and low halves, and 0 <= p < threshold <= 2^16 holds iff
+    // the high half is zero and the low half, unsigned, is <= threshold - 1.
+    __attribute__((target("sse4.1")))
+    inline __m128i match(__m128i b, __m128i g, __m128i r, __m128i limit)
+    {
+        const auto bg = _mm_mullo_epi16(b, g);
+        const auto lo = _mm_mullo_epi16(bg, r);
+        const auto hi = _mm_mulhi_epi16(bg, r);
+        return _mm_and_si128(
+            _mm_cmpeq_epi16(hi, _mm_setzero_si128()),
+            _mm_cmpeq_epi16(_mm_min_epu16(lo, limit), lo));
+    }
+
+    __attribute__((target("avx2")))
+    inline __m256i match(__m256i b, __m256i g, __m256i r, __m256i limit)
+    {
+        const auto bg = _mm256_mullo_epi16(b, g);
+        const auto lo = _mm256_mullo_epi16(bg, r);
+        const auto hi = _mm256_mulhi_epi16(bg, r);
+        return _mm256_and_si256(
+            _mm256_cmpeq_epi16(hi, _mm256_setzero_si256()),
+            _mm256_cmpeq_epi16(_mm256_min_epu16(lo, limit), lo));
+    }
+
+    // 16 pixels per iteration: three loads, nine shuffles, widened to two
+    // halves of eight 16-bit lanes.
+    __attribute__((target("sse4.1,popcnt")))
+    inline uint64_t count_sse41(const char* data, size_t pixels, uint32_t threshold)
+    {
+        const auto limit = _mm_set1_epi16(static_cast<short>(threshold - 1));
+
+        uint64_t cnt{};
+        size_t i{};
+        for (; i + 16 <= pixels; i += 16)
+        {
+            const auto* p = reinterpret_cast<const __m128i*>(data + i * 3);
+            const auto a = _mm_loadu_si128(p), b = _mm_loadu_si128(p + 1), c = _mm_loadu_si128(p + 2);
+            const auto ch0 = channel(a, b, c, 0), ch1 = channel(a, b, c, 1), ch2 = channel(a, b, c, 2);
+
+            const auto lo = match(_mm_cvtepi8_epi16(ch0), _mm_cvtepi8_epi16(ch1), _mm_cvtepi8_epi16(ch2), limit);
+            const auto hi = match(
+                _mm_cvtepi8_epi16(_mm_srli_si128(ch0, 8)),
+                _mm_cvtepi8_epi16(_mm_srli_si128(ch1, 8)),
+                _mm_cvtepi8_epi16(_mm_srli_si128(ch2, 8)), limit);
+            cnt += _mm_popcnt_u32(_mm_movemask_epi8(_mm_packs_epi16(lo, hi)));
+        }
+
+        return cnt + count_product_below_scalar(data + i * 3, pixels - i, threshold);
+    }
+
+    // 32 pixels per iteration: two 16-pixel deinterleaves, each widened into
+    // one 256-bit register of sixteen 16-bit lanes.
+    __attribute__((target("avx2,popcnt")))
+    inline uint64_t count_avx2(const char* data, size_t pixels, uint32_t threshold)
+    {
+        const auto limit = _mm256_set1_epi16(static_cast<short>(threshold - 1));
+
+        uint64_t cnt{};
+        size_t i{};
+        for (; i + 32 <= pixels; i += 32)
+        {
+            __m256i masks[2];
+            for (int half = 0; half < 2; ++half)
+            {
+                const auto* p = reinterpret_cast<const __m128i*>(data + (i + half * 16) * 3);
+                const auto a = _mm_loadu_si128(p), b = _mm_loadu_si128(p + 1), c = _mm_loadu_si128(p + 2);
+                masks[half] = match(
+                    _mm256_cvtepi8_epi16(channel(a, b, c, 0)),
+                    _mm256_cvtepi8_epi16(channel(a, b, c, 1)),
+                    _mm256_cvtepi8_epi16(channel(a, b, c, 2)), limit);
+            }
+            cnt += _mm_popcnt_u32(_mm256_movemask_epi8(_mm256_packs_epi16(masks[0], masks[1])));
+        }
+
+        return cnt + count_sse41(data + i * 3, pixels - i, threshold);
+    }
+}
+#endif
+
+inline simd_level detect_simd_level()
+{
+#ifdef KERNEL_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt"))
+        return simd_level::avx2;
+    if (__builtin_cpu_supports("sse4.1") && __builtin_cpu_supports("popcnt"))
+        return simd_level::sse41;
+#endif
+    return simd_level::scalar;
+}
+
+// Runs the requested implementation; the caller makes sure the CPU has it.
+inline uint64_t count_product_below(simd_level level, const char* data, size_t pixels, uint32_t threshold = 1000)
+{
+    if (!threshold)
+        return 0;
+
+#ifdef KERNEL_X86
+    // The 16-bit lanes only represent products up to 2^16.
+    if (threshold <= 1U << 16)
+    {
+        if (level == simd_level::avx2)
+            return kernel_detail::count_avx2(data, pixels, threshold);
+        if (level == simd_level::sse41)
+            return kernel_detail::count_sse41(data, pixels, threshold);
+    }
+#endif
+    return count_product_below_scalar(data, pixels, threshold);
+}
+
+inline uint64_t count_product_below(const char* data, size_t pixels, uint32_t threshold = 1000)
+{
+    static const auto level = detect_simd_level();
+    return count_product_below(level, data, pixels, threshold);
+}
+
+inline uint64_t count_product_below(simd_level level, const pixel_view& view, uint32_t threshold = 1000)
+{
+    uint64_t cnt{};
+    for (size_t y{}; y < view.height; ++y)
+        cnt += count_product_below(level, view.row(y), view.width, threshold);
+
+    return cnt;
+}
+
+inline uint64_t count_product_below(const pixel_view& view, uint32_t threshold = 1000)
+{
+    static const auto level = detect_simd_level();
+    return count_product_below(level, view, threshold);
+}
@@ -0,0 +1,352 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+#include "perf_counters.h"
+
+// Per-phase instrumentation. Every phase_span records, for the thread it runs
+// on, the wall and CPU time of one stretch of a phase ("load", "compute",
+// "send", ...) and the bytes it got through.
+//
+// Nothing is recorded unless the BGR_METRICS or BGR_TRACE environment
+// variable is set. BGR_METRICS names a file, or "-" for stderr, and the
+// process writes a JSON report there when it exits. A forked child writes its
+// own report, of its own spans, to the same name with ".<pid>" appended.
+// Disabled, a span costs a check of one flag.
+//
+// For each phase the report gives the spans, threads, wall time from its first
+// start to its last end, CPU time, bytes and throughput, and the imbalance: the
+// busiest thread's time over the mean thread's. The per-thread totals follow.
+//
+// BGR_TRACE names a Chrome trace-event file (chrome://tracing, Perfetto) that
+// gets every span as its own event. The process that starts first creates it;
+// it and every child forked from it append their spans at exit, so they share
+// one timeline on the host's monotonic clock. The trace is a JSON array left
+// open, which the format allows, so that each process appends independently.
+// Give processes started separately, e.g. 6b's standalone workers, their own
+// files.
+//
+// With BGR_PERF=1 as well, each span also reads the perf_event counters of its
+// thread, opened on the thread's first span, and both outputs carry them. The
+// reads are system calls, so that mode is for spans of at least tens of
+// microseconds.
+
+struct span_record
+{
+    const char* phase;
+    uint64_t tid;
+    int64_t start_ns;
+    int64_t end_ns;
+    int64_t cpu_ns;
+    uint64_t bytes;
+    perf_values perf;
+};
+
+namespace metrics_detail
+{
+    inline int64_t wall_ns()
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    inline int64_t thread_cpu_ns()
+    {
+#ifdef _WIN32
+        FILETIME creation, exit, kernel, user;
+        GetThreadTimes(GetCurrentThread(), &creation, &exit, &kernel, &user);
+        const auto ticks = [](const FILETIME& t) { return static_cast<int64_t>(t.dwHighDateTime) << 32 | t.dwLowDateTime; };
+        return (ticks(kernel) + ticks(user)) * 100;
+#else
+        timespec ts;
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+        return static_cast<int64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+#endif
+    }
+
+    inline uint64_t thread_id()
+    {
+#ifdef _WIN32
+        return GetCurrentThreadId();
+#else
+        return static_cast<uint64_t>(syscall(SYS_gettid));
+#endif
+    }
+
+    inline uint64_t process_id()
+    {
+#ifdef _WIN32
+        return GetCurrentProcessId();
+#else
+        return static_cast<uint64_t>(getpid());
+#endif
+    }
+}
+
+class metrics_registry
+{
+public:
+    // Never destroyed, so the report can still be written from atexit().
+    static metrics_registry& instance()
+    {
+        static auto* registry = new metrics_registry;
+        return *registry;
+    }
+
+    bool enabled() const { return m_enabled; }
+    bool perf_enabled() const { return m_perf; }
+
+    void add(const span_record& record)
+    {
+        std::lock_guard _(m_mutex);
+        m_records.push_back(record);
+    }
+
+    // Spans recorded so far, e.g. for a trace of this process.
+    std::vector<span_record> records() const
+    {
+        std::lock_guard _(m_mutex);
+        return m_records;
+    }
+
+    void write(std::ostream& out) const
+    {
+        struct totals
+        {
+            uint64_t spans{};
+            int64_t first_ns{ INT64_MAX };
+            int64_t last_ns{ INT64_MIN };
+            int64_t busy_ns{};
+            int64_t cpu_ns{};
+            uint64_t bytes{};
+            perf_values perf;
+        };
+
+        std::vector<std::string> phases;
+        std::map<std::string, totals> by_phase;
+        std::map<std::pair<std::string, uint64_t>, totals> by_thread;
+        {
+            std::lock_guard _(m_mutex);
+            for (auto&& r : m_records)
+            {
+                if (!by_phase.count(r.phase))
+                    phases.push_back(r.phase);
+                for (auto* t : { &by_phase[r.phase], &by_thread[{ r.phase, r.tid }] })
+                {
+                    ++t->spans;
+                    t->first_ns = std::min(t->first_ns, r.start_ns);
+                    t->last_ns = std::max(t->last_ns, r.end_ns);
+                    t->busy_ns += r.end_ns - r.start_ns;
+                    t->cpu_ns += r.cpu_ns;
+                    t->bytes += r.bytes;
+                    t->perf += r.perf;
+                }
+            }
+        }
+
+        const auto ms = [](int64_t ns) { return ns / 1e6; };
+        out << "{\n  \"pid\": " << metrics_detail::process_id() << ",\n  \"phases\": [";
+        for (size_t i{}; i < phases.size(); ++i)
+        {
+            const auto& p = by_phase[phases[i]];
+            size_t threads{};
+            int64_t max_ns{};
+            for (auto&& [key, t] : by_thread)
+                if (key.first == phases[i])
+                {
+                    ++threads;
+                    max_ns = std::max(max_ns, t.busy_ns);
+                }
+            const auto mean_ns = static_cast<double>(p.busy_ns) / threads;
+            const auto wall_ns = p.last_ns - p.first_ns;
+
+            out << (i ? ",\n" : "\n") << "    { \"name\": \"" << phases[i] << "\", \"spans\": " << p.spans << ", \"threads\": " << threads
+                << ", \"wall_ms\": " << ms(wall_ns) << ", \"cpu_ms\": " << ms(p.cpu_ns) << ", \"bytes\": " << p.bytes
+                << ", \"gbps\": " << (wall_ns ? p.bytes / static_cast<double>(wall_ns) : 0)
+                << ", \"thread_ms_max\": " << ms(max_ns) << ", \"thread_ms_mean\": " << mean_ns / 1e6
+                << ", \"imbalance\": " << (mean_ns > 0 ? max_ns / mean_ns : 1) << perf_fields(p.perf) << " }";
+        }
+        out << "\n  ],\n  \"threads\": [";
+        bool first{ true };
+        for (auto&& [key, t] : by_thread)
+        {
+            out << (first ? "\n" : ",\n") << "    { \"phase\": \"" << key.first << "\", \"tid\": " << key.second << ", \"spans\": " << t.spans
+                << ", \"busy_ms\": " << ms(t.busy_ns) << ", \"cpu_ms\": " << ms(t.cpu_ns) << ", \"bytes\": " << t.bytes << perf_fields(t.perf) << " }";
+            first = false;
+        }
+        out << "\n  ]\n}\n";
+    }
+
+private:
+    metrics_registry()
+    {
+        const auto* path = std::getenv("BGR_METRICS");
+        const auto* trace_path = std::getenv("BGR_TRACE");
+        m_path = path ? path : "";
+        m_trace_path = trace_path ? trace_path : "";
+        if (m_path.empty() && m_trace_path.empty())
+            return;
+
+        m_enabled = true;
+        m_perf = std::getenv("BGR_PERF") && std::string(std::getenv("BGR_PERF")) == "1";
+        m_pid = metrics_detail::process_id();
+        if (!m_trace_path.empty())
+            std::ofstream(m_trace_path, std::ios::out | std::ios::trunc) << "[\n";
+#ifndef _WIN32
+        // The lock is held across fork() so the child's copy is consistent; the
+        // child then drops its parent's spans.
+        pthread_atfork([] { instance().m_mutex.lock(); }, [] { instance().m_mutex.unlock(); }, [] {
+            auto& registry = instance();
+            registry.m_records.clear();
+            registry.m_mutex.unlock();
+            });
+#endif
+        std::atexit([] {
+            instance().write_report();
+            instance().write_trace();
+            });
+    }
+
+    void write_report() const
+    {
+        if (m_path.empty())
+            return;
+        if (m_path == "-")
+        {
+            write(std::cerr);
+            return;
+        }
+
+        const auto pid = metrics_detail::process_id();
+        std::ofstream out(pid == m_pid ? m_path : m_path + "." + std::to_string(pid));
+        write(out);
+    }
+
+    // Complete ("X") events in microseconds, appended in one write so that
+    // processes exiting together do not interleave.
+    void write_trace() const
+    {
+        if (m_trace_path.empty())
+            return;
+
+        const auto pid = metrics_detail::process_id();
+        std::ostringstream out;
+        out << std::fixed << std::setprecision(3);
+        out << "{ \"name\": \"process_name\", \"ph\": \"M\", \"pid\": " << pid << ", \"args\": { \"name\": \""
+            << (pid == m_pid ? "main " : "child ") << pid << "\" } },\n";
+        for (auto&& r : records())
+            out << "{ \"name\": \"" << r.phase << "\", \"cat\": \"bgr\", \"ph\": \"X\", \"pid\": " << pid << ", \"tid\": " << r.tid
+                << ", \"ts\": " << r.start_ns / 1e3 << ", \"dur\": " << (r.end_ns - r.start_ns) / 1e3
+                << ", \"args\": { \"bytes\": " << r.bytes << ", \"cpu_us\": " << r.cpu_ns / 1e3 << perf_fields(r.perf) << " } },\n";
+
+        const auto events = out.str();
+#ifdef _WIN32
+        std::ofstream(m_trace_path, std::ios::out | std::ios::app | std::ios::binary) << events;
+#else
+        const auto fd = open(m_trace_path.c_str(), O_WRONLY | O_APPEND);
+        for (size_t written{}; fd >= 0 && written < events.size();)
+        {
+            const auto rc = ::write(fd, events.data() + written, events.size() - written);
+            if (rc <= 0)
+                break;
+            written += rc;
+        }
+        if (fd >= 0)
+            close(fd);
+#endif
+    }
+
+    // ", \"cycles\": N, ..." for the events that were counted.
+    static std::string perf_fields(const perf_values& perf)
+    {
+        std::string fields;
+        for (size_t i{}; i < PERF_EVENTS_NUM; ++i)
+            if (perf.has(i))
+                fields += std::string(", \"") + perf_event_name(i) + "\": " + std::to_string(perf.value[i]);
+        return fields;
+    }
+
+    bool m_enabled{};
+    bool m_perf{};
+    std::string m_path;
+    std::string m_trace_path;
+    uint64_t m_pid{};
+    mutable std::mutex m_mutex;
+    std::vector<span_record> m_records;
+};
+
+// Read before main(), so the registry knows the parent's pid before any fork.
+inline const bool metrics_enabled = metrics_registry::instance().enabled();
+
+// Times the enclosing scope as one stretch of `phase` on this thread. The
+// phase name must outlive the process's report, e.g. a string literal.
+class phase_span
+{
+public:
+    explicit phase_span(const char* phase, uint64_t bytes = 0)
+        : m_phase(phase), m_bytes(bytes)
+    {
+        if (!metrics_enabled)
+            return;
+
+        m_active = true;
+        m_start_ns = metrics_detail::wall_ns();
+        m_cpu_ns = metrics_detail::thread_cpu_ns();
+        if (metrics_registry::instance().perf_enabled())
+            m_perf = thread_counters().read();
+    }
+
+    phase_span(const phase_span&) = delete;
+    phase_span& operator=(const phase_span&) = delete;
+
+    ~phase_span()
+    {
+        if (m_active)
+            metrics_registry::instance().add({ m_phase, metrics_detail::thread_id(), m_start_ns, metrics_detail::wall_ns(),
+                metrics_detail::thread_cpu_ns() - m_cpu_ns, m_bytes,
+                metrics_registry::instance().perf_enabled() ? thread_counters().read() - m_perf : perf_values{} });
+    }
+
+    void add_bytes(uint64_t bytes) { m_bytes += bytes; }
+
+    // Ends the span without recording it, e.g. in a forked child that should
+    // not report its parent's phase.
+    void discard() { m_active = false; }
+
+private:
+    const char* m_phase;
+    uint64_t m_bytes;
+    bool m_active{};
+    int64_t m_start_ns{};
+    int64_t m_cpu_ns{};
+    perf_values m_perf;
+
+    static const perf_counters& thread_counters()
+    {
+        static thread_local const perf_counters counters;
+        return counters;
+    }
+};
@@ -0,0 +1,207 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdlib>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+// NUMA topology from sysfs and thread pinning, without libnuma. A machine, VM
+// or container that shows no nodes is one node of the CPUs the process may run
+// on, and pinning anywhere but Linux does nothing.
+//
+// Pin plans put the workers of one node at consecutive indices. The pool deals
+// a parallel_for out in contiguous blocks in worker order, and an OpenMP static
+// schedule does the same, so each node then scans one contiguous range of rows
+// and memory first touched by those workers stays local to them.
+
+enum class pin_policy
+{
+    none,    // leave placement to the scheduler
+    compact, // fill the CPUs of node 0, then node 1, ...
+    scatter, // spread the workers evenly over the nodes, for their bandwidth
+};
+
+inline const char* pin_policy_name(pin_policy policy)
+{
+    switch (policy)
+    {
+    case pin_policy::compact: return "compact";
+    case pin_policy::scatter: return "scatter";
+    default: return "none";
+    }
+}
+
+inline bool parse_pin_policy(const std::string& name, pin_policy& policy)
+{
+    for (auto p : { pin_policy::none, pin_policy::compact, pin_policy::scatter })
+        if (name == pin_policy_name(p))
+        {
+            policy = p;
+            return true;
+        }
+    return false;
+}
+
+// BGR_PIN=none|compact|scatter, read once; none when unset or unknown.
+inline pin_policy default_pin_policy()
+{
+    static const auto policy = [] {
+        auto p = pin_policy::none;
+        if (const auto* name = std::getenv("BGR_PIN"))
+            parse_pin_policy(name, p);
+        return p;
+    }();
+    return policy;
+}
+
+class numa_topology
+{
+public:
+    static const numa_topology& instance()
+    {
+        static const numa_topology topology;
+        return topology;
+    }
+
+    size_t nodes() const { return m_cpus.size(); }
+    const std::vector<int>& cpus(size_t node) const { return m_cpus[node]; }
+
+    // CPU for each of `threads` workers, -1 for unpinned, and its node.
+    struct slot
+    {
+        int cpu;
+        size_t node;
+    };
+
+    std::vector<slot> plan(pin_policy policy, size_t threads) const
+    {
+        std::vector<slot> slots;
+        if (policy == pin_policy::none)
+        {
+            slots.assign(threads, { -1, 0 });
+            return slots;
+        }
+
+        if (policy == pin_policy::compact)
+        {
+            std::vector<slot> all;
+            for (size_t node{}; node < nodes(); ++node)
+                for (auto cpu : m_cpus[node])
+                    all.push_back({ cpu, node });
+            for (size_t i{}; i < threads; ++i)
+                slots.push_back(all[i % all.size()]);
+            return slots;
+        }
+
+        for (size_t node{}; node < nodes(); ++node)
+        {
+            const auto first = node * threads / nodes();
+            const auto last = (node + 1) * threads / nodes();
+            for (auto i = first; i < last; ++i)
+                slots.push_back({ m_cpus[node][(i - first) % m_cpus[node].size()], node });
+        }
+        return slots;
+    }
+
+private:
+    numa_topology()
+    {
+#ifdef __linux__
+        cpu_set_t allowed;
+        CPU_ZERO(&allowed);
+        const auto have_mask = sched_getaffinity(0, sizeof(allowed), &allowed) == 0;
+        const auto usable = [&](int cpu) { return !have_mask || (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed)); };
+
+        for (size_t node{};; ++node)
+        {
+            std::ifstream list("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+            if (!list.is_open())
+                break;
+
+            std::vector<int> cpus;
+            std::string text;
+            std::getline(list, text);
+            for (size_t pos{}; pos < text.size();)
+            {
+                auto end = text.find(',', pos);
+                if (end == std::string::npos)
+                    end = text.size();
+                const auto range = text.substr(pos, end - pos);
+                const auto dash = range.find('-');
+                const auto first = std::atoi(range.c_str());
+                const auto last = dash == std::string::npos ? first : std::atoi(range.c_str() + dash + 1);
+                for (auto cpu = first; cpu <= last; ++cpu)
+                    if (usable(cpu))
+                        cpus.push_back(cpu);
+                pos = end + 1;
+            }
+            if (!cpus.empty())
+                m_cpus.push_back(std::move(cpus));
+        }
+
+        if (m_cpus.empty())
+        {
+            m_cpus.emplace_back();
+            for (int cpu{}; cpu < CPU_SETSIZE; ++cpu)
+                if (have_mask && CPU_ISSET(cpu, &allowed))
+                    m_cpus.back().push_back(cpu);
+        }
+#endif
+        if (m_cpus.empty() || m_cpus.front().empty())
+            m_cpus.assign(1, { -1 });
+    }
+
+    std::vector<std::vector<int>> m_cpus;
+};
+
+// Binds the calling thread to `cpu`; -1, or a failure, leaves it unbound.
+inline bool pin_current_thread(int cpu)
+{
+#ifdef __linux__
+    if (cpu < 0 || cpu >= CPU_SETSIZE)
+        return false;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return sched_setaffinity(0, sizeof(set), &set) == 0;
+#else
+    (void)cpu;
+    return false;
+#endif
+}
+
+// Saves the calling thread's CPU mask and puts it back when destroyed, e.g.
+// around an OpenMP region, which pins the calling thread as its thread 0.
+class affinity_guard
+{
+public:
+    affinity_guard()
+    {
+#ifdef __linux__
+        CPU_ZERO(&m_saved);
+        m_valid = sched_getaffinity(0, sizeof(m_saved), &m_saved) == 0;
+#endif
+    }
+
+    affinity_guard(const affinity_guard&) = delete;
+    affinity_guard& operator=(const affinity_guard&) = delete;
+
+    ~affinity_guard()
+    {
+#ifdef __linux__
+        if (m_valid)
+            sched_setaffinity(0, sizeof(m_saved), &m_saved);
+#endif
+    }
+
+private:
+#ifdef __linux__
+    cpu_set_t m_saved;
+    bool m_valid{};
+#endif
+};
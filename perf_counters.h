@@ -0,0 +1,214 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+// Hardware and software event counters through perf_event_open(2), counted in
+// user space only so that they open unprivileged under perf_event_paranoid 2.
+// Every event is opened on its own: whatever the kernel, PMU, VM or paranoia
+// level refuses is simply left out, and describe() says why. Elsewhere than
+// Linux nothing opens.
+//
+// No per-thread event sees memory controller traffic, so the bandwidth callers
+// report is an estimate: last-level cache misses times the line size.
+
+static constexpr size_t PERF_EVENTS_NUM{ 7 };
+static constexpr size_t PERF_CACHE_LINE{ 64 };
+
+enum perf_event_index : size_t { perf_cycles, perf_instructions, perf_llc_misses, perf_branch_misses, perf_task_clock, perf_page_faults, perf_context_switches };
+
+inline const char* perf_event_name(size_t event)
+{
+    static constexpr const char* names[PERF_EVENTS_NUM]{ "cycles", "instructions", "llc_misses", "branch_misses",
+        "task_clock_ns", "page_faults", "context_switches" };
+    return names[event];
+}
+
+// Counts per event; an event whose bit is clear in `valid` could not be counted.
+struct perf_values
+{
+    std::array<uint64_t, PERF_EVENTS_NUM> value{};
+    uint32_t valid{};
+
+    bool has(size_t event) const { return valid >> event & 1; }
+
+    perf_values& operator+=(const perf_values& other)
+    {
+        for (size_t i{}; i < PERF_EVENTS_NUM; ++i)
+            value[i] += other.value[i];
+        valid |= other.valid;
+        return *this;
+    }
+
+    perf_values operator-(const perf_values& before) const
+    {
+        auto delta = *this;
+        for (size_t i{}; i < PERF_EVENTS_NUM; ++i)
+            delta.value[i] -= before.value[i];
+        delta.valid &= before.valid;
+        return delta;
+    }
+};
+
+// The events of one thread. With `inherit`, threads it creates afterwards are
+// counted too, once they have exited.
+class perf_counters
+{
+public:
+    explicit perf_counters(int tid = 0, bool inherit = false)
+    {
+        m_fds.fill(-1);
+#ifdef __linux__
+        static constexpr std::pair<uint32_t, uint64_t> events[PERF_EVENTS_NUM]{
+            { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+            { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+            { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+            { PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+            { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK },
+            { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS },
+            { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES },
+        };
+
+        for (size_t i{}; i < PERF_EVENTS_NUM; ++i)
+        {
+            perf_event_attr attr;
+            std::memset(&attr, 0, sizeof(attr));
+            attr.size = sizeof(attr);
+            attr.type = events[i].first;
+            attr.config = events[i].second;
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            attr.inherit = inherit;
+            attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+            m_fds[i] = static_cast<int>(syscall(SYS_perf_event_open, &attr, tid, -1, -1, PERF_FLAG_FD_CLOEXEC));
+            m_errors[i] = m_fds[i] < 0 ? errno : 0;
+        }
+#else
+        (void)tid;
+        (void)inherit;
+#endif
+    }
+
+    perf_counters(perf_counters&& other) noexcept { swap(other); }
+    perf_counters& operator=(perf_counters&& other) noexcept { swap(other); return *this; }
+    perf_counters(const perf_counters&) = delete;
+    perf_counters& operator=(const perf_counters&) = delete;
+
+    ~perf_counters()
+    {
+#ifdef __linux__
+        for (auto fd : m_fds)
+            if (fd >= 0)
+                close(fd);
+#endif
+    }
+
+    bool any_open() const
+    {
+        for (auto fd : m_fds)
+            if (fd >= 0)
+                return true;
+        return false;
+    }
+
+    // Running totals, scaled up when the kernel had to multiplex the PMU.
+    perf_values read() const
+    {
+        perf_values values;
+#ifdef __linux__
+        for (size_t i{}; i < PERF_EVENTS_NUM; ++i)
+        {
+            uint64_t data[3]{};
+            if (m_fds[i] < 0 || ::read(m_fds[i], data, sizeof(data)) != sizeof(data) || !data[2])
+                continue;
+            values.value[i] = data[2] == data[1] ? data[0] : static_cast<uint64_t>(static_cast<double>(data[0]) * data[1] / data[2]);
+            values.valid |= 1U << i;
+        }
+#endif
+        return values;
+    }
+
+    // "cycles: No such file or directory, ..." for every event that did not
+    // open, followed by the paranoia level.
+    std::string describe() const
+    {
+        std::string text;
+        for (size_t i{}; i < PERF_EVENTS_NUM; ++i)
+            if (m_fds[i] < 0)
+                text += std::string(text.empty() ? "" : ", ") + perf_event_name(i) + ": " + (m_errors[i] ? std::strerror(m_errors[i]) : "unsupported");
+        if (text.empty())
+            return "all events open";
+
+        std::ifstream paranoid("/proc/sys/kernel/perf_event_paranoid");
+        int level{};
+        if (paranoid >> level)
+            text += "; perf_event_paranoid=" + std::to_string(level);
+        return text;
+    }
+
+private:
+    void swap(perf_counters& other) noexcept
+    {
+        std::swap(m_fds, other.m_fds);
+        std::swap(m_errors, other.m_errors);
+    }
+
+    std::array<int, PERF_EVENTS_NUM> m_fds{ -1, -1, -1, -1, -1, -1, -1 };
+    std::array<int, PERF_EVENTS_NUM> m_errors{};
+};
+
+// The events of every thread the process has now, and of the threads they
+// start later: pool and OpenMP workers that already exist, and pthreads
+// created per call.
+class process_perf_counters
+{
+public:
+    process_perf_counters()
+    {
+#ifdef __linux__
+        std::error_code ec;
+        for (auto&& entry : std::filesystem::directory_iterator("/proc/self/task", ec))
+        {
+            const auto tid = std::stoi(entry.path().filename().string());
+            m_threads.emplace_back(tid, perf_counters(tid, true));
+        }
+#endif
+    }
+
+    perf_values read() const
+    {
+        perf_values total;
+        for (auto&& [tid, counters] : m_threads)
+            total += counters.read();
+        return total;
+    }
+
+    std::vector<std::pair<int, perf_values>> per_thread() const
+    {
+        std::vector<std::pair<int, perf_values>> values;
+        for (auto&& [tid, counters] : m_threads)
+            values.emplace_back(tid, counters.read());
+        return values;
+    }
+
+    std::string describe() const
+    {
+        return m_threads.empty() ? "no threads found" : m_threads.front().second.describe();
+    }
+
+private:
+    std::vector<std::pair<int, perf_counters>> m_threads;
+};
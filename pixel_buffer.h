@@ -0,0 +1,264 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <new>
+#include <string>
+#include <utility>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <Windows.h>
+#else
+#include <sys/mman.h>
+#endif
+
+// Pixel buffers from a process-wide arena: 64-byte aligned for vector loads,
+// backed by 2 MiB pages when large, and recycled from image to image.
+//
+// A request of HUGE_PAGE_SIZE or more is rounded up to whole huge pages and
+// mapped with explicit huge pages (MAP_HUGETLB, or MEM_LARGE_PAGES on
+// Windows) when the system has them reserved; otherwise it is mapped 2 MiB
+// aligned and marked for transparent huge pages, and failing that it is plain
+// pages. Smaller requests come from the heap, rounded up to a power of two.
+// BGR_HUGE_PAGES=0 maps large buffers with plain pages, for comparison.
+//
+// A released buffer stays mapped for the next request that fits it, so a loop
+// over images of similar size allocates once. Up to ARENA_MAX_CACHED_BYTES
+// are kept idle; beyond that, released buffers are returned to the system.
+
+static constexpr size_t BUFFER_ALIGNMENT{ 64 };
+static constexpr size_t HUGE_PAGE_SIZE{ 2U << 20 };
+static constexpr size_t ARENA_MAX_CACHED_BYTES{ 1ULL << 30 };
+
+enum class page_kind { heap, normal, transparent_huge, explicit_huge };
+
+inline const char* page_kind_name(page_kind kind)
+{
+    switch (kind)
+    {
+    case page_kind::normal: return "normal";
+    case page_kind::transparent_huge: return "thp";
+    case page_kind::explicit_huge: return "hugetlb";
+    default: return "heap";
+    }
+}
+
+struct buffer_block
+{
+    char* data{};
+    size_t capacity{};
+    page_kind kind{ page_kind::heap };
+};
+
+class buffer_arena
+{
+public:
+    // Never destroyed, so buffers held by other statics can still be released.
+    static buffer_arena& instance()
+    {
+        static auto* arena = new buffer_arena;
+        return *arena;
+    }
+
+    // A block of at least `size` bytes, idle or new. `reuse` false always maps
+    // new memory, e.g. so that its pages are first touched where they are used.
+    buffer_block acquire(size_t size, bool reuse = true)
+    {
+        const auto capacity = round_up(std::max<size_t>(size, 1));
+        if (reuse)
+        {
+            std::lock_guard _(m_mutex);
+            // Only blocks up to twice the rounded size, so a small image does
+            // not tie up a large buffer.
+            const auto it = m_free.lower_bound(capacity);
+            if (it != m_free.end() && it->first <= capacity * 2)
+            {
+                const auto block = it->second;
+                m_free.erase(it);
+                m_cached_bytes -= block.capacity;
+                ++m_hits;
+                return block;
+            }
+            ++m_misses;
+        }
+        return map(capacity);
+    }
+
+    void release(const buffer_block& block)
+    {
+        if (!block.data)
+            return;
+        {
+            std::lock_guard _(m_mutex);
+            if (m_cached_bytes + block.capacity <= ARENA_MAX_CACHED_BYTES)
+            {
+                m_free.emplace(block.capacity, block);
+                m_cached_bytes += block.capacity;
+                return;
+            }
+        }
+        unmap(block);
+    }
+
+    // Returns every idle block to the system.
+    void trim()
+    {
+        std::multimap<size_t, buffer_block> idle;
+        {
+            std::lock_guard _(m_mutex);
+            idle.swap(m_free);
+            m_cached_bytes = 0;
+        }
+        for (auto&& [capacity, block] : idle)
+            unmap(block);
+    }
+
+    // "hits=N, misses=N, idle_bytes=N"
+    std::string describe() const
+    {
+        std::lock_guard _(m_mutex);
+        return "hits=" + std::to_string(m_hits) + ", misses=" + std::to_string(m_misses) + ", idle_bytes=" + std::to_string(m_cached_bytes);
+    }
+
+private:
+    buffer_arena()
+    {
+        const auto* huge = std::getenv("BGR_HUGE_PAGES");
+        m_huge_pages = !huge || std::string(huge) != "0";
+    }
+
+    // Heap sizes to the next power of two from 4 KiB, mapped sizes to whole
+    // huge pages, so that similar requests land on the same blocks.
+    static size_t round_up(size_t size)
+    {
+        if (size >= HUGE_PAGE_SIZE)
+            return (size + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+        size_t capacity{ 4096 };
+        while (capacity < size)
+            capacity *= 2;
+        return capacity;
+    }
+
+    buffer_block map(size_t capacity) const
+    {
+        if (capacity < HUGE_PAGE_SIZE)
+            return { static_cast<char*>(::operator new(capacity, std::align_val_t{ BUFFER_ALIGNMENT })), capacity, page_kind::heap };
+
+#ifdef _WIN32
+        if (m_huge_pages && GetLargePageMinimum() && capacity % GetLargePageMinimum() == 0)
+            if (auto* data = VirtualAlloc(NULL, capacity, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE))
+                return { static_cast<char*>(data), capacity, page_kind::explicit_huge };
+        if (auto* data = VirtualAlloc(NULL, capacity, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE))
+            return { static_cast<char*>(data), capacity, page_kind::normal };
+#else
+#ifdef MAP_HUGETLB
+        // Fails at once, rather than on first touch, when too few huge pages
+        // are reserved.
+        if (m_huge_pages)
+        {
+            auto* data = mmap(nullptr, capacity, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+            if (data != MAP_FAILED)
+                return { static_cast<char*>(data), capacity, page_kind::explicit_huge };
+        }
+#endif
+        // Over-map by one huge page and cut the ends off, so the block starts
+        // on a 2 MiB boundary and every page of it can be a huge one.
+        auto* raw = mmap(nullptr, capacity + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (raw != MAP_FAILED)
+        {
+            auto* base = static_cast<char*>(raw);
+            auto* data = base + (HUGE_PAGE_SIZE - reinterpret_cast<uintptr_t>(base) % HUGE_PAGE_SIZE) % HUGE_PAGE_SIZE;
+            if (data != base)
+                munmap(base, data - base);
+            munmap(data + capacity, base + HUGE_PAGE_SIZE - data);
+
+            auto kind = page_kind::normal;
+#ifdef MADV_HUGEPAGE
+            if (m_huge_pages && madvise(data, capacity, MADV_HUGEPAGE) == 0)
+                kind = page_kind::transparent_huge;
+#endif
+            return { data, capacity, kind };
+        }
+#endif
+        throw std::bad_alloc();
+    }
+
+    static void unmap(const buffer_block& block)
+    {
+        if (block.kind == page_kind::heap)
+        {
+            ::operator delete(block.data, std::align_val_t{ BUFFER_ALIGNMENT });
+            return;
+        }
+#ifdef _WIN32
+        VirtualFree(block.data, 0, MEM_RELEASE);
+#else
+        munmap(block.data, block.capacity);
+#endif
+    }
+
+    bool m_huge_pages{};
+    mutable std::mutex m_mutex;
+    std::multimap<size_t, buffer_block> m_free;
+    size_t m_cached_bytes{};
+    size_t m_hits{};
+    size_t m_misses{};
+};
+
+// Owns a buffer from the arena and gives it back when destroyed. Unlike a
+// std::vector<char> it leaves new bytes uninitialized, since they are always
+// about to be read into.
+class pixel_buffer
+{
+public:
+    pixel_buffer() = default;
+
+    explicit pixel_buffer(size_t size, bool reuse = true)
+        : m_block(buffer_arena::instance().acquire(size, reuse)), m_size(size)
+    {
+    }
+
+    pixel_buffer(pixel_buffer&& other) noexcept { swap(other); }
+    pixel_buffer& operator=(pixel_buffer&& other) noexcept { swap(other); return *this; }
+    pixel_buffer(const pixel_buffer&) = delete;
+    pixel_buffer& operator=(const pixel_buffer&) = delete;
+
+    ~pixel_buffer() { buffer_arena::instance().release(m_block); }
+
+    char* data() { return m_block.data; }
+    const char* data() const { return m_block.data; }
+    size_t size() const { return m_size; }
+    size_t capacity() const { return m_block.capacity; }
+    bool empty() const { return !m_size; }
+    page_kind kind() const { return m_block.kind; }
+
+    // Keeps the first bytes, up to the smaller of the two sizes.
+    void resize(size_t size)
+    {
+        if (size > m_block.capacity)
+        {
+            pixel_buffer larger(std::max(size, m_block.capacity * 2));
+            if (m_size)
+                std::memcpy(larger.data(), data(), m_size);
+            swap(larger);
+        }
+        m_size = size;
+    }
+
+private:
+    void swap(pixel_buffer& other) noexcept
+    {
+        std::swap(m_block, other.m_block);
+        std::swap(m_size, other.m_size);
+    }
+
+    buffer_block m_block;
+    size_t m_size{};
+};
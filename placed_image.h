@@ -0,0 +1,83 @@
+#pragma once
+
+#include <cstring>
+#include <vector>
+
+#include "bmp.h"
+#include "numa.h"
+#include "pixel_buffer.h"
+#include "reduce.h"
+#include "thread_pool.h"
+
+// Copy of an image's pixels whose pages are first touched, and so allocated,
+// on the node of the worker that will scan them. A mapped file's pages sit
+// wherever the page cache put them, usually the loader's node; scanning this
+// copy with the same policy reads node-local memory instead.
+//
+// Under thread_policy worker i copies block i of the pool's for_each_worker
+// split, which nothing steals; scan the copy with the same split, as 3.cpp's
+// proceed_placed does. Under openmp_policy the threads are pinned by `pin`
+// and copy rows under schedule(static), which hands a loop of the same length
+// on the same team to the same threads, as in 4.cpp.
+// Placement is worth its copy only for images that are scanned repeatedly.
+class placed_image
+{
+public:
+    template <typename Policy = serial_policy>
+    explicit placed_image(const pixel_view& view, const Policy& policy = {}, pin_policy pin = default_pin_policy())
+    {
+        if (!view.height)
+            return;
+
+        // Never a recycled buffer, whose pages are already placed, and left
+        // uninitialized, so no page is touched before its worker copies.
+        m_data = pixel_buffer(view.stride * (view.height - 1) + view.row_size(), false);
+        m_view = { m_data.data(), view.width, view.height, view.stride };
+
+        const auto copy = [&](size_t first, size_t last) {
+            phase_span span("place", (last - first) * view.row_size());
+            for (auto y = first; y < last; ++y)
+                std::memcpy(const_cast<char*>(m_view.row(y)), view.row(y), view.row_size());
+        };
+
+        if constexpr (std::is_same_v<Policy, thread_policy>)
+        {
+            auto& pool = policy.pool ? *policy.pool : thread_pool::instance();
+            pool.for_each_worker(0, view.height, [&copy](size_t, size_t first, size_t last) { copy(first, last); });
+        }
+        else if constexpr (std::is_same_v<Policy, openmp_policy>)
+        {
+#ifdef _OPENMP
+            const auto threads = policy.threads ? policy.threads : omp_get_max_threads();
+            std::vector<numa_topology::slot> slots;
+            if (pin != pin_policy::none)
+                slots = numa_topology::instance().plan(pin, threads);
+            const affinity_guard restore;
+#pragma omp parallel num_threads(threads)
+            {
+                if (static_cast<size_t>(omp_get_thread_num()) < slots.size())
+                    pin_current_thread(slots[omp_get_thread_num()].cpu);
+                phase_span span("place");
+#pragma omp for schedule(static)
+                for (size_t y = 0; y < view.height; ++y)
+                {
+                    std::memcpy(const_cast<char*>(m_view.row(y)), view.row(y), view.row_size());
+                    span.add_bytes(view.row_size());
+                }
+            }
+#else
+            (void)policy;
+            copy(0, view.height);
+#endif
+        }
+        else
+            copy(0, view.height);
+        (void)pin;
+    }
+
+    const pixel_view& view() const { return m_view; }
+
+private:
+    pixel_buffer m_data;
+    pixel_view m_view{};
+};
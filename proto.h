@@ -0,0 +1,155 @@
+#pragma once
+
+#include <cstdint>
+
+// Wire format between the 6b.cpp coordinator and its workers. Every message is
+// a fixed-size frame header followed by `length` bytes of body. All integers
+// are little-endian, whatever the host.
+//
+//   frame header  magic u32 | version u16 | type u16 | job_id u64 | length u64
+//   job           transport u32 | threshold u32 | first u64 | last u64 |
+//                 width u64 | payload u64, then `payload` pixel bytes
+//   result        cnt u64 | recv_ns u64 | compute_ns u64
+//   bye           no body; the worker closes the connection
+//   heartbeat     no body; sent by a worker every HEARTBEAT_INTERVAL_MS,
+//                 also while it is busy with a job
+//   hello         cores u32 | workers u32; a worker's first frame, sent
+//                 again whenever workers registering below it change them
+//   failed        no body; the worker cannot count the job with this id,
+//                 e.g. its own copy of the image does not cover the range
+//                 or the job's width or payload size is wrong, and the job
+//                 has to run elsewhere
+//
+// One connection carries any number of jobs back to back. The worker answers
+// each with a result frame carrying the same job id, so the coordinator can
+// keep several jobs in flight without a round trip between them. A worker
+// talks the same protocol to the workers registered below it, as their
+// coordinator.
+
+static constexpr uint32_t PROTO_MAGIC{ 0x36524742 }; // "BGR6"
+static constexpr uint16_t PROTO_VERSION{ 3 };
+
+static constexpr auto FRAME_HEADER_SIZE{ 24U };
+static constexpr auto JOB_BODY_SIZE{ 40U };
+static constexpr auto RESULT_BODY_SIZE{ 24U };
+static constexpr auto HELLO_BODY_SIZE{ 8U };
+static constexpr auto HEARTBEAT_INTERVAL_MS{ 200U };
+
+enum class frame_type : uint16_t { job = 1, result = 2, bye = 3, heartbeat = 4, hello = 5, failed = 6 };
+
+struct frame_header
+{
+    frame_type type{};
+    uint64_t job_id{};
+    uint64_t length{};
+};
+
+// A byte range of the image and the predicate to count it with.
+struct job_body
+{
+    uint32_t transport{};
+    uint32_t threshold{};
+    uint64_t first{};
+    uint64_t last{};
+    uint64_t width{};
+    uint64_t payload{};
+};
+
+struct result_body
+{
+    uint64_t cnt{};
+    uint64_t recv_ns{};
+    uint64_t compute_ns{};
+};
+
+// What a worker brings, counting itself and every worker below it.
+struct hello_body
+{
+    uint32_t cores{};
+    uint32_t workers{};
+};
+
+namespace proto_detail
+{
+    template <typename T>
+    void put(char*& out, T value)
+    {
+        for (size_t i{}; i < sizeof(T); ++i)
+            *out++ = static_cast<char>(static_cast<uint64_t>(value) >> (8 * i));
+    }
+
+    template <typename T>
+    T get(const char*& in)
+    {
+        uint64_t value{};
+        for (size_t i{}; i < sizeof(T); ++i)
+            value |= static_cast<uint64_t>(static_cast<uint8_t>(*in++)) << (8 * i);
+        return static_cast<T>(value);
+    }
+}
+
+inline void encode(const frame_header& header, char* out)
+{
+    proto_detail::put(out, PROTO_MAGIC);
+    proto_detail::put(out, PROTO_VERSION);
+    proto_detail::put(out, static_cast<uint16_t>(header.type));
+    proto_detail::put(out, header.job_id);
+    proto_detail::put(out, header.length);
+}
+
+// Fails on a foreign magic or another protocol version.
+inline bool decode(const char* in, frame_header& header)
+{
+    const auto magic = proto_detail::get<uint32_t>(in);
+    const auto version = proto_detail::get<uint16_t>(in);
+    header.type = static_cast<frame_type>(proto_detail::get<uint16_t>(in));
+    header.job_id = proto_detail::get<uint64_t>(in);
+    header.length = proto_detail::get<uint64_t>(in);
+    return magic == PROTO_MAGIC && version == PROTO_VERSION;
+}
+
+inline void encode(const job_body& job, char* out)
+{
+    proto_detail::put(out, job.transport);
+    proto_detail::put(out, job.threshold);
+    proto_detail::put(out, job.first);
+    proto_detail::put(out, job.last);
+    proto_detail::put(out, job.width);
+    proto_detail::put(out, job.payload);
+}
+
+inline void decode(const char* in, job_body& job)
+{
+    job.transport = proto_detail::get<uint32_t>(in);
+    job.threshold = proto_detail::get<uint32_t>(in);
+    job.first = proto_detail::get<uint64_t>(in);
+    job.last = proto_detail::get<uint64_t>(in);
+    job.width = proto_detail::get<uint64_t>(in);
+    job.payload = proto_detail::get<uint64_t>(in);
+}
+
+inline void encode(const result_body& result, char* out)
+{
+    proto_detail::put(out, result.cnt);
+    proto_detail::put(out, result.recv_ns);
+    proto_detail::put(out, result.compute_ns);
+}
+
+inline void decode(const char* in, result_body& result)
+{
+    result.cnt = proto_detail::get<uint64_t>(in);
+    result.recv_ns = proto_detail::get<uint64_t>(in);
+    result.compute_ns = proto_detail::get<uint64_t>(in);
+}
+
+inline void encode(const hello_body& hello, char* out)
+{
+    proto_detail::put(out, hello.cores);
+    proto_detail::put(out, hello.workers);
+}
+
+inline void decode(const char* in, hello_body& hello)
+{
+    hello.cores = proto_detail::get<uint32_t>(in);
+    hello.workers = proto_detail::get<uint32_t>(in);
+}
@@ -0,0 +1,360 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <mutex>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "bmp.h"
+#include "kernel.h"
+#include "thread_pool.h"
+
+// reduce_pixels<Predicate, Reduction>(view, policy) folds every pixel that
+// satisfies Predicate into Reduction. Both are plain functor types, so the
+// whole loop is instantiated and inlined per combination.
+//
+// A predicate is `bool operator()(const pixel&) const`.
+// A reduction is default-constructible and has `void add(const pixel&)` and
+// `void merge(const Reduction&)`; each worker reduces its own copy.
+//
+// reduce_fused(view, policy, query<Predicate, Reduction>{}...) answers several
+// such pairs in one pass over memory and returns a tuple of their results.
+
+struct pixel
+{
+    char b;
+    char g;
+    char r;
+
+    uint8_t operator[](size_t channel) const { return static_cast<uint8_t>(channel == 0 ? b : channel == 1 ? g : r); }
+};
+
+// Predicates
+
+struct any_pixel
+{
+    bool operator()(const pixel&) const { return true; }
+};
+
+// The original check, signed-char arithmetic included.
+struct product_below
+{
+    uint32_t threshold{ 1000 };
+
+    bool operator()(const pixel& px) const { return static_cast<size_t>(px.b) * px.g * px.r < threshold; }
+};
+
+// Channel intensity (0..255) within [lo, hi].
+struct channel_in_range
+{
+    size_t channel{};
+    uint8_t lo{};
+    uint8_t hi{ 255 };
+
+    bool operator()(const pixel& px) const { return px[channel] >= lo && px[channel] <= hi; }
+};
+
+// Reductions. Channel statistics are over the unsigned 0..255 intensities.
+
+struct count_reduction
+{
+    uint64_t value{};
+
+    void add(const pixel&) { ++value; }
+    void merge(const count_reduction& other) { value += other.value; }
+};
+
+struct sum_reduction
+{
+    std::array<uint64_t, 3> value{};
+
+    void add(const pixel& px)
+    {
+        for (size_t c{}; c < 3; ++c)
+            value[c] += px[c];
+    }
+
+    void merge(const sum_reduction& other)
+    {
+        for (size_t c{}; c < 3; ++c)
+            value[c] += other.value[c];
+    }
+};
+
+struct min_max_reduction
+{
+    std::array<uint8_t, 3> min{ 255, 255, 255 };
+    std::array<uint8_t, 3> max{};
+
+    void add(const pixel& px)
+    {
+        for (size_t c{}; c < 3; ++c)
+        {
+            min[c] = std::min(min[c], px[c]);
+            max[c] = std::max(max[c], px[c]);
+        }
+    }
+
+    void merge(const min_max_reduction& other)
+    {
+        for (size_t c{}; c < 3; ++c)
+        {
+            min[c] = std::min(min[c], other.min[c]);
+            max[c] = std::max(max[c], other.max[c]);
+        }
+    }
+};
+
+// Count, sum and sum of squares per channel, for the mean and variance.
+struct moments_reduction
+{
+    uint64_t count{};
+    std::array<uint64_t, 3> sum{};
+    std::array<uint64_t, 3> sum_sq{};
+
+    void add(const pixel& px)
+    {
+        ++count;
+        for (size_t c{}; c < 3; ++c)
+        {
+            sum[c] += px[c];
+            sum_sq[c] += px[c] * px[c];
+        }
+    }
+
+    void merge(const moments_reduction& other)
+    {
+        count += other.count;
+        for (size_t c{}; c < 3; ++c)
+        {
+            sum[c] += other.sum[c];
+            sum_sq[c] += other.sum_sq[c];
+        }
+    }
+
+    double mean(size_t channel) const { return count ? static_cast<double>(sum[channel]) / count : 0; }
+
+    double variance(size_t channel) const
+    {
+        const auto m = mean(channel);
+        return count ? static_cast<double>(sum_sq[channel]) / count - m * m : 0;
+    }
+};
+
+struct histogram_reduction
+{
+    std::array<std::array<uint64_t, 256>, 3> value{};
+
+    void add(const pixel& px)
+    {
+        for (size_t c{}; c < 3; ++c)
+            ++value[c][px[c]];
+    }
+
+    void merge(const histogram_reduction& other)
+    {
+        for (size_t c{}; c < 3; ++c)
+            for (size_t i{}; i < 256; ++i)
+                value[c][i] += other.value[c][i];
+    }
+};
+
+// Execution policies
+
+struct serial_policy {};
+
+struct thread_policy
+{
+    thread_pool* pool{};   // nullptr runs on thread_pool::instance()
+    size_t chunk_size{ 256U << 10 };
+};
+
+struct openmp_policy
+{
+    int threads{};  // 0 keeps the OpenMP default
+};
+
+template <typename Predicate, typename Reduction>
+void reduce_rows(const pixel_view& view, const Predicate& pred, Reduction& red)
+{
+    // The plain count of the original predicate goes through the SIMD kernel.
+    if constexpr (std::is_same_v<Predicate, product_below> && std::is_same_v<Reduction, count_reduction>)
+    {
+        red.value += count_product_below(view, pred.threshold);
+    }
+    else
+    {
+        for (size_t y{}; y < view.height; ++y)
+        {
+            const auto* data = view.row(y);
+            for (size_t i{}; i < view.row_size(); i += 3)
+            {
+                const pixel px{ data[i], data[i + 1], data[i + 2] };
+                if (pred(px))
+                    red.add(px);
+            }
+        }
+    }
+}
+
+template <typename Predicate, typename Reduction, typename Policy = serial_policy>
+Reduction reduce_pixels(const pixel_view& view, const Policy& policy = {}, const Predicate& pred = {})
+{
+    Reduction result{};
+
+    if constexpr (std::is_same_v<Policy, serial_policy>)
+    {
+        reduce_rows(view, pred, result);
+    }
+    else if constexpr (std::is_same_v<Policy, thread_policy>)
+    {
+        auto& pool = policy.pool ? *policy.pool : thread_pool::instance();
+        const auto chunk_rows = std::max<size_t>(1, policy.chunk_size / std::max<size_t>(1, view.stride));
+
+        std::mutex m;
+        pool.parallel_for(0, view.height, chunk_rows, [&](size_t first, size_t last) {
+            Reduction local{};
+            reduce_rows(view.rows(first, last - first), pred, local);
+
+            std::lock_guard _(m);
+            result.merge(local);
+        });
+    }
+    else if constexpr (std::is_same_v<Policy, openmp_policy>)
+    {
+#ifdef _OPENMP
+        const auto threads = policy.threads ? policy.threads : omp_get_max_threads();
+#pragma omp parallel num_threads(threads)
+        {
+            Reduction local{};
+#pragma omp for schedule(static)
+            for (long y = 0; y < static_cast<long>(view.height); ++y)
+                reduce_rows(view.rows(y, 1), pred, local);
+
+#pragma omp critical
+            result.merge(local);
+        }
+#else
+        (void)policy;
+        reduce_rows(view, pred, result);
+#endif
+    }
+    else
+    {
+        static_assert(sizeof(Policy) == 0, "unknown execution policy");
+    }
+
+    return result;
+}
+
+// Fused queries
+
+// One predicate and the reduction of the pixels it selects.
+template <typename Predicate, typename Reduction>
+struct query
+{
+    using reduction_type = Reduction;
+
+    Predicate pred{};
+};
+
+// Every query runs over a block of about this many bytes before the next
+// block is read, so only the first one takes it from memory.
+static constexpr auto FUSED_BLOCK_SIZE{ 32U << 10 };
+
+namespace reduce_detail
+{
+    // Whole rows while they fit in a block, otherwise pieces of one row.
+    template <typename Fn>
+    void for_each_block(const pixel_view& view, Fn&& fn)
+    {
+        if (view.row_size() <= FUSED_BLOCK_SIZE)
+        {
+            const auto block_rows = std::max<size_t>(1, FUSED_BLOCK_SIZE / view.stride);
+            for (size_t y{}; y < view.height; y += block_rows)
+                fn(view.rows(y, std::min(block_rows, view.height - y)));
+            return;
+        }
+
+        const auto block_pixels = FUSED_BLOCK_SIZE / 3;
+        for (size_t y{}; y < view.height; ++y)
+            for (size_t x{}; x < view.width; x += block_pixels)
+                fn(pixel_view{ view.row(y) + x * 3, std::min<size_t>(block_pixels, view.width - x), 1, view.stride });
+    }
+
+    template <typename Results, size_t... I, typename... Queries>
+    void reduce_blocks(const pixel_view& view, Results& results, std::index_sequence<I...>, const Queries&... queries)
+    {
+        for_each_block(view, [&](const pixel_view& block) {
+            (reduce_rows(block, queries.pred, std::get<I>(results)), ...);
+        });
+    }
+
+    template <typename Results, size_t... I>
+    void merge_results(Results& into, const Results& from, std::index_sequence<I...>)
+    {
+        (std::get<I>(into).merge(std::get<I>(from)), ...);
+    }
+}
+
+template <typename Policy, typename... Queries>
+std::tuple<typename Queries::reduction_type...> reduce_fused(const pixel_view& view, const Policy& policy, const Queries&... queries)
+{
+    using results_type = std::tuple<typename Queries::reduction_type...>;
+    constexpr auto indices = std::index_sequence_for<Queries...>{};
+    results_type results{};
+
+    if constexpr (std::is_same_v<Policy, serial_policy>)
+    {
+        reduce_detail::reduce_blocks(view, results, indices, queries...);
+    }
+    else if constexpr (std::is_same_v<Policy, thread_policy>)
+    {
+        auto& pool = policy.pool ? *policy.pool : thread_pool::instance();
+        const auto chunk_rows = std::max<size_t>(1, policy.chunk_size / std::max<size_t>(1, view.stride));
+
+        std::mutex m;
+        pool.parallel_for(0, view.height, chunk_rows, [&](size_t first, size_t last) {
+            results_type local{};
+            reduce_detail::reduce_blocks(view.rows(first, last - first), local, indices, queries...);
+
+            std::lock_guard _(m);
+            reduce_detail::merge_results(results, local, indices);
+        });
+    }
+    else if constexpr (std::is_same_v<Policy, openmp_policy>)
+    {
+#ifdef _OPENMP
+        const auto threads = policy.threads ? policy.threads : omp_get_max_threads();
+        const auto block_rows = std::max<size_t>(1, FUSED_BLOCK_SIZE / std::max<size_t>(1, view.stride));
+        const auto blocks = static_cast<long>((view.height + block_rows - 1) / block_rows);
+#pragma omp parallel num_threads(threads)
+        {
+            results_type local{};
+#pragma omp for schedule(static)
+            for (long i = 0; i < blocks; ++i)
+                reduce_detail::reduce_blocks(view.rows(i * block_rows, std::min(block_rows, view.height - i * block_rows)), local, indices, queries...);
+
+#pragma omp critical
+            reduce_detail::merge_results(results, local, indices);
+        }
+#else
+        (void)policy;
+        reduce_detail::reduce_blocks(view, results, indices, queries...);
+#endif
+    }
+    else
+    {
+        static_assert(sizeof(Policy) == 0, "unknown execution policy");
+    }
+
+    return results;
+}
@@ -0,0 +1,170 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "bmp.h"
+#include "reduce.h"
+#include "thread_pool.h"
+
+// Summed-area table of the product < threshold matches, so the number of
+// matching pixels in any rectangle is four lookups.
+//
+// Coordinates are pixel columns and rows as the view stores them; for an
+// ordinary bottom-up BMP row 0 is the bottom row of the picture. The table has
+// a zero first row and column, so entry (x, y) is the count over [0, x) x
+// [0, y) and no query needs a bounds check.
+//
+// The build splits the rows into bands. Each band reads its pixels once and
+// fills its part of the table as if it started at row 0; a second, lighter
+// pass adds to every band the running column totals of the bands above it.
+// Entries are 32-bit, so images are limited to 2^32 - 1 pixels.
+
+class region_index
+{
+public:
+    template <typename Policy = serial_policy>
+    bool build(const pixel_view& view, uint32_t threshold = 1000, const Policy& policy = {})
+    {
+        m_width = view.width;
+        m_height = view.height;
+        m_threshold = threshold;
+        if (view.pixels() > UINT32_MAX)
+        {
+            m_sums.reset();
+            return false;
+        }
+
+        const auto columns = m_width + 1;
+        // Left uninitialized: every entry is written by the band that owns
+        // it, which also places its pages near that band's thread.
+        m_sums.reset(new uint32_t[columns * (m_height + 1)]);
+        std::fill_n(m_sums.get(), columns, 0U);
+
+        const auto bands = std::max<size_t>(1, std::min(m_height, band_count(policy)));
+        const auto band_rows = (m_height + bands - 1) / bands;
+        const product_below pred{ threshold };
+
+        for_each_band(policy, bands, [&](size_t band) {
+            const auto first = band * band_rows;
+            const auto last = std::min(m_height, first + band_rows);
+            for (auto y = first; y < last; ++y)
+            {
+                const auto* data = view.row(y);
+                auto* out = row(y + 1);
+                const auto* above = y == first ? nullptr : row(y);
+                uint32_t running{};
+                out[0] = 0;
+                for (size_t x{}; x < m_width; ++x)
+                {
+                    running += pred({ data[x * 3], data[x * 3 + 1], data[x * 3 + 2] });
+                    out[x + 1] = running + (above ? above[x + 1] : 0);
+                }
+            }
+            });
+
+        // carry[b] is what band b is missing: the column totals of all the
+        // bands above it.
+        std::vector<uint32_t> carry(bands * columns);
+        for (size_t band{ 1 }; band < bands; ++band)
+        {
+            const auto* last = row(std::min(m_height, band * band_rows));
+            for (size_t x{}; x < columns; ++x)
+                carry[band * columns + x] = carry[(band - 1) * columns + x] + last[x];
+        }
+
+        for_each_band(policy, bands, [&](size_t band) {
+            if (!band)
+                return;
+            const auto* add = carry.data() + band * columns;
+            for (auto y = band * band_rows; y < std::min(m_height, (band + 1) * band_rows); ++y)
+            {
+                auto* out = row(y + 1);
+                for (size_t x{}; x < columns; ++x)
+                    out[x] += add[x];
+            }
+            });
+
+        return true;
+    }
+
+    // Matches in [x0, x1) x [y0, y1), clamped to the image.
+    uint64_t count(size_t x0, size_t y0, size_t x1, size_t y1) const
+    {
+        x1 = std::min(x1, m_width);
+        y1 = std::min(y1, m_height);
+        if (!m_sums || x0 >= x1 || y0 >= y1)
+            return 0;
+
+        return static_cast<uint32_t>(row(y1)[x1] - row(y0)[x1] - row(y1)[x0] + row(y0)[x0]);
+    }
+
+    uint64_t total() const { return count(0, 0, m_width, m_height); }
+
+    bool is_built() const { return m_sums != nullptr; }
+    size_t width() const { return m_width; }
+    size_t height() const { return m_height; }
+    uint32_t threshold() const { return m_threshold; }
+    size_t bytes() const { return m_sums ? (m_width + 1) * (m_height + 1) * sizeof(uint32_t) : 0; }
+
+private:
+    uint32_t* row(size_t y) { return m_sums.get() + y * (m_width + 1); }
+    const uint32_t* row(size_t y) const { return m_sums.get() + y * (m_width + 1); }
+
+    // A few bands per thread, so a slow thread holds back little.
+    static size_t band_count(const serial_policy&) { return 1; }
+
+    static size_t band_count(const thread_policy& policy)
+    {
+        return (policy.pool ? *policy.pool : thread_pool::instance()).size() * 4;
+    }
+
+    static size_t band_count(const openmp_policy& policy)
+    {
+#ifdef _OPENMP
+        return (policy.threads ? policy.threads : omp_get_max_threads()) * 4;
+#else
+        (void)policy;
+        return 1;
+#endif
+    }
+
+    template <typename Fn>
+    static void for_each_band(const serial_policy&, size_t bands, Fn&& fn)
+    {
+        for (size_t band{}; band < bands; ++band)
+            fn(band);
+    }
+
+    template <typename Fn>
+    static void for_each_band(const thread_policy& policy, size_t bands, Fn&& fn)
+    {
+        auto& pool = policy.pool ? *policy.pool : thread_pool::instance();
+        pool.parallel_for(0, bands, 1, [&fn](size_t first, size_t last) {
+            for (auto band = first; band < last; ++band)
+                fn(band);
+            });
+    }
+
+    template <typename Fn>
+    static void for_each_band(const openmp_policy& policy, size_t bands, Fn&& fn)
+    {
+#ifdef _OPENMP
+        const auto threads = policy.threads ? policy.threads : omp_get_max_threads();
+#pragma omp parallel for schedule(dynamic, 1) num_threads(threads)
+        for (long band = 0; band < static_cast<long>(bands); ++band)
+            fn(band);
+#else
+        (void)policy;
+        for (size_t band{}; band < bands; ++band)
+            fn(band);
+#endif
+    }
+
+    size_t m_width{};
+    size_t m_height{};
+    uint32_t m_threshold{};
+    std::unique_ptr<uint32_t[]> m_sums;
+};
@@ -0,0 +1,82 @@
+// Counts product < threshold matches over a set of images for many thresholds
+// at the cost of one scan, through one threshold_histogram over all of them.
+//
+//   ./sweep [-t threshold]... [-r first:last:step] file.bmp...
+//
+// Prints a CSV row per threshold to stdout. Thresholds above the exact range
+// that do not fall on a bin edge are printed with exact=0 and the count below
+// the nearest edge.
+
+#include <chrono>
+#include <filesystem>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "bmp.h"
+#include "reduce.h"
+#include "thread_pool.h"
+#include "threshold_histogram.h"
+
+int main(int argc, char* argv[])
+{
+    std::vector<uint32_t> thresholds;
+    std::vector<std::filesystem::path> paths;
+
+    for (int i{ 1 }; i < argc; ++i)
+    {
+        const std::string arg = argv[i];
+        if (arg == "-t" && i + 1 < argc)
+            thresholds.push_back(static_cast<uint32_t>(std::stoul(argv[++i])));
+        else if (arg == "-r" && i + 1 < argc)
+        {
+            const std::string range = argv[++i];
+            const auto colon = range.find(':');
+            const auto second = range.find(':', colon + 1);
+            if (colon == std::string::npos || second == std::string::npos)
+            {
+                std::cerr << "Bad range: " << range << '\n';
+                return -1;
+            }
+            const auto first = std::stoul(range.substr(0, colon));
+            const auto last = std::stoul(range.substr(colon + 1, second - colon - 1));
+            const auto step = std::max(1UL, std::stoul(range.substr(second + 1)));
+            for (auto t = first; t <= last; t += step)
+                thresholds.push_back(static_cast<uint32_t>(t));
+        }
+        else
+            paths.push_back(arg);
+    }
+    if (thresholds.empty() || paths.empty())
+    {
+        std::cerr << "Usage: " << argv[0] << " [-t threshold]... [-r first:last:step] file.bmp...\n";
+        return -1;
+    }
+
+    const auto start = std::chrono::steady_clock::now();
+    threshold_histogram histogram;
+    size_t pixels{};
+    for (auto&& path : paths)
+    {
+        const bmp_image image(path);
+        if (!image.is_open())
+        {
+            std::cerr << "Failed to open file: path=" << path << '\n';
+            return -1;
+        }
+        histogram.add(image.view(), thread_policy{});
+        pixels += image.view().pixels();
+    }
+    const auto ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+    std::cout << "threshold,cnt,exact\n";
+    for (auto threshold : thresholds)
+    {
+        uint64_t cnt;
+        const auto exact = histogram.count_below(threshold, cnt);
+        std::cout << threshold << ',' << cnt << ',' << exact << '\n';
+    }
+    std::cerr << "sweep: images=" << paths.size() << ", pixels=" << pixels << ", thresholds=" << thresholds.size() << ", scan_ms=" << ms << '\n';
+
+    return 0;
+}
@@ -0,0 +1,320 @@
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdlib>
+#include <filesystem>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <linux/futex.h>
+#include <poll.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "bmp.h"
+#include "kernel.h"
+
+// Linux counterpart of 1e.cpp (Event), 1f.cpp (Mutex) and 1g.cpp (Semaphore):
+// every thread counts its slice of the image, then all threads fold their
+// local_cnt into the shared total through the primitive under test. A barrier
+// between the two phases makes every thread reach the reduction together, the
+// worst case for contention.
+//
+// For each primitive and thread count it reports the reduction phase latency
+// (first thread entering to last thread leaving, median and p99 over ROUNDS),
+// the mean time a thread spends in its own reduce, and the share of
+// acquisitions that found the primitive already held.
+
+static const std::filesystem::path INPUT_FILEPATH{ "img01.bmp" };
+static constexpr auto ROUNDS{ 2000U };
+
+using bench_clock = std::chrono::steady_clock;
+
+struct mutex_reducer
+{
+    static constexpr auto NAME{ "pthread_mutex" };
+    pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+    uint64_t cnt{};
+
+    bool add(size_t, uint64_t local_cnt)
+    {
+        const bool contended = pthread_mutex_trylock(&mutex) != 0;
+        if (contended)
+            pthread_mutex_lock(&mutex);
+        cnt += local_cnt;
+        pthread_mutex_unlock(&mutex);
+        return contended;
+    }
+
+    uint64_t total() const { return cnt; }
+};
+
+struct semaphore_reducer
+{
+    static constexpr auto NAME{ "sem_t" };
+    sem_t sem;
+    uint64_t cnt{};
+
+    semaphore_reducer() { sem_init(&sem, 0, 1); }
+    ~semaphore_reducer() { sem_destroy(&sem); }
+
+    bool add(size_t, uint64_t local_cnt)
+    {
+        const bool contended = sem_trywait(&sem) != 0;
+        if (contended)
+            while (sem_wait(&sem) != 0)
+                ;
+        cnt += local_cnt;
+        sem_post(&sem);
+        return contended;
+    }
+
+    uint64_t total() const { return cnt; }
+};
+
+// eventfd in semaphore mode holding a single token, the closest thing to the
+// auto-reset Win32 event of 1e.cpp.
+struct eventfd_reducer
+{
+    static constexpr auto NAME{ "eventfd" };
+    int fd{ eventfd(1, EFD_SEMAPHORE | EFD_NONBLOCK) };
+    uint64_t cnt{};
+
+    ~eventfd_reducer() { close(fd); }
+
+    bool add(size_t, uint64_t local_cnt)
+    {
+        uint64_t token;
+        const bool contended = read(fd, &token, sizeof(token)) != sizeof(token);
+        if (contended)
+            for (pollfd pfd{ fd, POLLIN, 0 }; read(fd, &token, sizeof(token)) != sizeof(token);)
+                poll(&pfd, 1, -1);
+        cnt += local_cnt;
+        token = 1;
+        ssize_t rc;
+        while ((rc = write(fd, &token, sizeof(token))) < 0 && errno == EINTR)
+            ;
+        // A lost token would leave every other thread waiting for it forever.
+        if (rc != sizeof(token))
+        {
+            std::cerr << "Failed to write eventfd: rc=" << rc << ", errno=" << errno << '\n';
+            std::abort();
+        }
+        return contended;
+    }
+
+    uint64_t total() const { return cnt; }
+};
+
+// Three-state futex mutex: 0 free, 1 held, 2 held with waiters.
+struct futex_reducer
+{
+    static constexpr auto NAME{ "futex" };
+    std::atomic<int> state{};
+    uint64_t cnt{};
+
+    bool add(size_t, uint64_t local_cnt)
+    {
+        int c{};
+        const bool contended = !state.compare_exchange_strong(c, 1, std::memory_order_acquire);
+        if (contended)
+        {
+            if (c != 2)
+                c = state.exchange(2, std::memory_order_acquire);
+            while (c != 0)
+            {
+                syscall(SYS_futex, reinterpret_cast<int*>(&state), FUTEX_WAIT_PRIVATE, 2, nullptr, nullptr, 0);
+                c = state.exchange(2, std::memory_order_acquire);
+            }
+        }
+
+        cnt += local_cnt;
+
+        if (state.fetch_sub(1, std::memory_order_release) != 1)
+        {
+            state.store(0, std::memory_order_release);
+            syscall(SYS_futex, reinterpret_cast<int*>(&state), FUTEX_WAKE_PRIVATE, 1, nullptr, nullptr, 0);
+        }
+        return contended;
+    }
+
+    uint64_t total() const { return cnt; }
+};
+
+struct spinlock_reducer
+{
+    static constexpr auto NAME{ "spinlock" };
+    std::atomic_flag flag = ATOMIC_FLAG_INIT;
+    uint64_t cnt{};
+
+    bool add(size_t, uint64_t local_cnt)
+    {
+        const bool contended = flag.test_and_set(std::memory_order_acquire);
+        if (contended)
+            while (flag.test_and_set(std::memory_order_acquire))
+                std::this_thread::yield();
+        cnt += local_cnt;
+        flag.clear(std::memory_order_release);
+        return contended;
+    }
+
+    uint64_t total() const { return cnt; }
+};
+
+struct atomic_reducer
+{
+    static constexpr auto NAME{ "atomic_fetch_add" };
+    std::atomic<uint64_t> cnt{};
+
+    bool add(size_t, uint64_t local_cnt)
+    {
+        cnt.fetch_add(local_cnt, std::memory_order_relaxed);
+        return false;
+    }
+
+    uint64_t total() const { return cnt; }
+};
+
+// Each thread owns a cache-line-sized slot; the slots are summed once the
+// threads are done, so nothing is shared during the reduction itself.
+struct padded_slots_reducer
+{
+    static constexpr auto NAME{ "padded_slots" };
+
+    struct alignas(64) slot
+    {
+        uint64_t cnt{};
+    };
+    std::vector<slot> slots;
+
+    explicit padded_slots_reducer(size_t threads_num)
+        : slots(threads_num)
+    {}
+
+    bool add(size_t tid, uint64_t local_cnt)
+    {
+        slots[tid].cnt += local_cnt;
+        return false;
+    }
+
+    uint64_t total() const
+    {
+        uint64_t cnt{};
+        for (auto&& slot : slots)
+            cnt += slot.cnt;
+        return cnt;
+    }
+};
+
+template <typename Reducer>
+void run(Reducer& reducer, const pixel_view& view, size_t threads_num, uint64_t expected);
+
+int main(int argc, char* argv[])
+{
+    const bmp_image image(INPUT_FILEPATH);
+    if (!image.is_open())
+    {
+        std::cerr << "Failed to open file: path=" << INPUT_FILEPATH << '\n';
+        return -1;
+    }
+
+    const auto& view = image.view();
+    const auto expected = count_product_below(view);
+    const size_t max_threads = argc >= 2 ? std::atoi(argv[1]) : std::max(1U, std::thread::hardware_concurrency());
+
+    std::cout << std::left << std::setw(18) << "primitive" << std::right
+        << std::setw(8) << "threads"
+        << std::setw(14) << "phase_ns_p50"
+        << std::setw(14) << "phase_ns_p99"
+        << std::setw(12) << "op_ns_mean"
+        << std::setw(12) << "contended" << '\n';
+
+    for (size_t threads_num{ 1 }; threads_num <= max_threads; ++threads_num)
+    {
+        { mutex_reducer r; run(r, view, threads_num, expected); }
+        { semaphore_reducer r; run(r, view, threads_num, expected); }
+        { eventfd_reducer r; run(r, view, threads_num, expected); }
+        { futex_reducer r; run(r, view, threads_num, expected); }
+        { spinlock_reducer r; run(r, view, threads_num, expected); }
+        { atomic_reducer r; run(r, view, threads_num, expected); }
+        { padded_slots_reducer r(threads_num); run(r, view, threads_num, expected); }
+    }
+
+    return 0;
+}
+
+template <typename Reducer>
+void run(Reducer& reducer, const pixel_view& view, size_t threads_num, uint64_t expected)
+{
+    struct sample
+    {
+        bench_clock::time_point enter;
+        bench_clock::time_point leave;
+    };
+
+    pthread_barrier_t barrier;
+    pthread_barrier_init(&barrier, NULL, threads_num);
+
+    std::vector<std::vector<sample>> samples(threads_num, std::vector<sample>(ROUNDS));
+    std::atomic<uint64_t> contended{};
+
+    std::vector<std::thread> workers;
+    for (size_t i{}; i < threads_num; ++i)
+        workers.emplace_back([&, tid = i] {
+        const auto start = tid * view.height / threads_num;
+        const auto end = (tid + 1) * view.height / threads_num;
+        const auto slice = view.rows(start, end - start);
+
+        uint64_t local_contended{};
+        for (size_t round{}; round < ROUNDS; ++round)
+        {
+            const auto local_cnt = count_product_below(slice);
+            pthread_barrier_wait(&barrier);
+
+            auto& s = samples[tid][round];
+            s.enter = bench_clock::now();
+            local_contended += reducer.add(tid, local_cnt);
+            s.leave = bench_clock::now();
+        }
+        contended += local_contended;
+            });
+
+    for (auto&& worker : workers)
+        worker.join();
+
+    pthread_barrier_destroy(&barrier);
+
+    std::vector<double> phase_ns(ROUNDS);
+    double op_ns{};
+    for (size_t round{}; round < ROUNDS; ++round)
+    {
+        auto enter = samples[0][round].enter;
+        auto leave = samples[0][round].leave;
+        for (auto&& thread_samples : samples)
+        {
+            enter = std::min(enter, thread_samples[round].enter);
+            leave = std::max(leave, thread_samples[round].leave);
+            op_ns += std::chrono::duration<double, std::nano>(thread_samples[round].leave - thread_samples[round].enter).count();
+        }
+        phase_ns[round] = std::chrono::duration<double, std::nano>(leave - enter).count();
+    }
+    std::sort(phase_ns.begin(), phase_ns.end());
+
+    const auto acquisitions = static_cast<double>(ROUNDS) * threads_num;
+    std::cout << std::left << std::setw(18) << Reducer::NAME << std::right << std::fixed << std::setprecision(0)
+        << std::setw(8) << threads_num
+        << std::setw(14) << phase_ns[ROUNDS / 2]
+        << std::setw(14) << phase_ns[ROUNDS * 99 / 100]
+        << std::setw(12) << op_ns / acquisitions
+        << std::setw(11) << std::setprecision(1) << 100.0 * contended / acquisitions << '%';
+    if (reducer.total() != expected * ROUNDS)
+        std::cout << "  WRONG total=" << reducer.total();
+    std::cout << '\n';
+}
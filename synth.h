@@ -0,0 +1,96 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+// Deterministic synthetic pixels. Every row is generated from (seed, y) alone,
+// so rows can be produced in parallel and in any order, and the same
+// parameters always give the same image.
+//
+//   uniform  every byte random
+//   match    every pixel matches the product < 1000 check (channels 0..9)
+//   none     no pixel matches (channels 128..255 are negative as signed char,
+//            so the product is negative)
+//   mixed    each pixel is a `match` pixel with probability `ratio`, else a
+//            `none` pixel
+
+enum class pixel_dist { uniform, match, none, mixed };
+
+struct synth_params
+{
+    pixel_dist dist{ pixel_dist::uniform };
+    double ratio{ 0.5 };
+    uint64_t seed{ 1 };
+};
+
+inline bool parse_pixel_dist(const std::string& name, pixel_dist& dist)
+{
+    if (name == "uniform")
+        dist = pixel_dist::uniform;
+    else if (name == "match")
+        dist = pixel_dist::match;
+    else if (name == "none")
+        dist = pixel_dist::none;
+    else if (name == "mixed")
+        dist = pixel_dist::mixed;
+    else
+        return false;
+    return true;
+}
+
+// splitmix64
+inline uint64_t synth_next(uint64_t& state)
+{
+    auto z = (state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+// Writes `width` pixels of row y into `row` and zeroes the padding up to `stride`.
+inline void synth_row(const synth_params& params, size_t y, char* row, size_t width, size_t stride)
+{
+    uint64_t state{ params.seed * 0xD1B54A32D192ED03ULL + y };
+    const auto match_below = static_cast<uint64_t>(params.ratio * 65536.0);
+
+    for (size_t x{}; x < width; ++x)
+    {
+        const auto bits = synth_next(state);
+        auto* px = row + x * 3;
+        switch (params.dist)
+        {
+        case pixel_dist::uniform:
+            px[0] = static_cast<char>(bits);
+            px[1] = static_cast<char>(bits >> 8);
+            px[2] = static_cast<char>(bits >> 16);
+            break;
+        case pixel_dist::match:
+            px[0] = static_cast<char>((bits & 0xFFFF) % 10);
+            px[1] = static_cast<char>((bits >> 16 & 0xFFFF) % 10);
+            px[2] = static_cast<char>((bits >> 32 & 0xFFFF) % 10);
+            break;
+        case pixel_dist::none:
+            px[0] = static_cast<char>(0x80 | bits);
+            px[1] = static_cast<char>(0x80 | bits >> 8);
+            px[2] = static_cast<char>(0x80 | bits >> 16);
+            break;
+        case pixel_dist::mixed:
+            if ((bits >> 48) < match_below)
+            {
+                px[0] = static_cast<char>((bits & 0xFFFF) % 10);
+                px[1] = static_cast<char>((bits >> 16 & 0xFFFF) % 10);
+                px[2] = static_cast<char>((bits >> 32 & 0xFFFF) % 10);
+            }
+            else
+            {
+                px[0] = static_cast<char>(0x80 | bits);
+                px[1] = static_cast<char>(0x80 | bits >> 8);
+                px[2] = static_cast<char>(0x80 | bits >> 16);
+            }
+            break;
+        }
+    }
+
+    std::memset(row + width * 3, 0, stride - width * 3);
+}
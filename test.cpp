@@ -0,0 +1,186 @@
+// Regression checks for cases that once gave wrong answers, each on a few
+// pixels built in memory. Prints one line per check and exits non-zero if any
+// failed.
+//
+//   g++ -std=c++17 -O2 -pthread test.cpp -o test && ./test
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "bmp.h"
+#include "reduce.h"
+#include "thread_pool.h"
+#include "threshold_histogram.h"
+#include "tile_cache.h"
+
+namespace
+{
+    uint64_t count_below_brute(const std::vector<signed char>& bgr, uint32_t threshold)
+    {
+        uint64_t cnt{};
+        for (size_t i{}; i < bgr.size(); i += 3)
+        {
+            const auto product = static_cast<int32_t>(bgr[i]) * bgr[i + 1] * bgr[i + 2];
+            cnt += product >= 0 && static_cast<uint32_t>(product) < threshold;
+        }
+        return cnt;
+    }
+
+    // Products near the top of the range: with channels -128 * -128 * 127 the
+    // largest is 2,080,768, above 127^3, and thresholds between the two must
+    // not count everything.
+    bool histogram_top_of_range()
+    {
+        const std::vector<signed char> bgr{ -128, -128, 127, -128, -127, 127, 1, 1, 1, 2, 2, 2 };
+        threshold_histogram histogram;
+        histogram.add(packed_view(reinterpret_cast<const char*>(bgr.data()), bgr.size()));
+
+        uint64_t cnt;
+        if (histogram.count_below(2060000, cnt) || cnt != 2)
+            return false;
+
+        for (auto threshold = HIST_MAX_PRODUCT - 3 * HIST_EXACT_LIMIT; threshold <= HIST_MAX_PRODUCT + 2; ++threshold)
+        {
+            const auto exact = histogram.count_below(threshold, cnt);
+            const auto expected = count_below_brute(bgr, threshold);
+            if (exact ? cnt != expected : cnt > expected)
+                return false;
+        }
+        return histogram.count_below(HIST_MAX_PRODUCT + 1, cnt) && cnt == bgr.size() / 3;
+    }
+
+    // Flipping the sign bit of the same 8-byte lane in two 32-byte blocks of a
+    // row once left the tile hash unchanged, so the edited image was served
+    // the old image's count.
+    bool tile_hash_two_flips()
+    {
+        const auto stride = bmp_row_stride(TILE_WIDTH);
+        std::vector<char> before(stride * TILE_HEIGHT, 1);
+        auto after = before;
+        after[7] ^= static_cast<char>(0x80);
+        after[39] ^= static_cast<char>(0x80);
+        const pixel_view view_before{ before.data(), TILE_WIDTH, TILE_HEIGHT, stride };
+        const pixel_view view_after{ after.data(), TILE_WIDTH, TILE_HEIGHT, stride };
+
+        if (tile_hash(view_before, 1000) == tile_hash(view_after, 1000))
+            return false;
+
+        thread_pool pool(1);
+        tile_cache cache;
+        count_incremental(view_before, cache, 1000, pool, nullptr, tile_cache_mode::always);
+        tile_stats stats;
+        const auto cnt = count_incremental(view_after, cache, 1000, pool, &stats, tile_cache_mode::always);
+        return cnt == TILE_WIDTH * TILE_HEIGHT - 2 && stats.recounted == 1;
+    }
+
+    // A saved cache is keyed the same whichever hash implementation the CPU
+    // runs, for full tiles and for the narrower ones at an image's edge.
+    bool tile_hash_levels_agree()
+    {
+        std::vector<char> data(bmp_row_stride(3 * TILE_WIDTH) * TILE_HEIGHT);
+        for (size_t i{}; i < data.size(); ++i)
+            data[i] = static_cast<char>(i * 2654435761U >> 13);
+
+        for (size_t width{ 1 }; width <= TILE_WIDTH; ++width)
+            for (size_t height : { size_t{ 1 }, size_t{ 7 }, size_t{ TILE_HEIGHT } })
+            {
+                const pixel_view tile{ data.data() + 5, width, height, bmp_row_stride(3 * TILE_WIDTH) };
+                if (tile_hash(simd_level::scalar, tile, 1000) != tile_hash(tile, 1000))
+                    return false;
+            }
+        return true;
+    }
+
+    // A cache file claiming more entries than it holds is damaged, not a
+    // reason to allocate them.
+    bool tile_cache_damaged_count()
+    {
+        const auto path = std::filesystem::temp_directory_path() / "bgr_test_tiles.cache";
+        {
+            tile_cache cache;
+            cache.insert(1, 2);
+            if (!cache.save(path))
+                return false;
+        }
+        {
+            std::fstream file(path, std::ios::in | std::ios::out | std::ios::binary);
+            const uint64_t entries{ ~uint64_t{} >> 4 };
+            file.seekp(8);
+            file.write(reinterpret_cast<const char*>(&entries), sizeof(entries));
+        }
+
+        tile_cache cache;
+        const auto loaded = cache.load(path);
+        std::filesystem::remove(path);
+        return !loaded;
+    }
+
+    // A task waiting on its nested parallel_for once ran the next submitted
+    // task on its own stack, which did the same, so batch overflowed the
+    // stack on a long list of files. Only the waited-for group may run there.
+    bool pool_nested_wait_depth()
+    {
+        thread_pool pool(2);
+        static thread_local int depth{};
+        std::atomic<int> deepest{};
+
+        task_group group;
+        for (int i{}; i < 64; ++i)
+            pool.submit(group, [&] {
+                ++depth;
+                int seen = deepest.load();
+                while (seen < depth && !deepest.compare_exchange_weak(seen, depth))
+                    ;
+                pool.parallel_for(0, 64, 1, [](size_t, size_t) { std::this_thread::yield(); });
+                --depth;
+                });
+        pool.wait(group);
+        return deepest == 1;
+    }
+
+    // placed_image copies and proceed_placed scans block i on worker i, so
+    // the same worker must get the same block on every call, never the caller.
+    bool pool_for_each_worker_mapping()
+    {
+        thread_pool pool(3);
+        std::vector<std::thread::id> first(3), again(3);
+        for (auto* ran : { &first, &again })
+            pool.for_each_worker(0, 300, [&](size_t index, size_t begin, size_t end) {
+                if (begin == index * 100 && end == begin + 100)
+                    (*ran)[index] = std::this_thread::get_id();
+                });
+
+        return first == again && std::count(first.begin(), first.end(), std::thread::id{}) == 0
+            && std::count(first.begin(), first.end(), std::this_thread::get_id()) == 0;
+    }
+}
+
+int main()
+{
+    const std::pair<const char*, std::function<bool()>> checks[]{
+        { "histogram_top_of_range", histogram_top_of_range },
+        { "tile_hash_two_flips", tile_hash_two_flips },
+        { "tile_hash_levels_agree", tile_hash_levels_agree },
+        { "tile_cache_damaged_count", tile_cache_damaged_count },
+        { "pool_nested_wait_depth", pool_nested_wait_depth },
+        { "pool_for_each_worker_mapping", pool_for_each_worker_mapping },
+    };
+
+    int failed{};
+    for (auto&& [name, check] : checks)
+    {
+        const auto ok = check();
+        std::cout << "test: " << name << (ok ? " ok" : " FAILED") << '\n';
+        failed += !ok;
+    }
+
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,265 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "numa.h"
+
+// Tasks submitted together; wait() returns once all of them have run.
+struct task_group
+{
+    std::atomic<size_t> pending{};
+};
+
+// Persistent pool with one deque per worker. A worker pops from the front of
+// its own deque and, when that is empty, steals from the back of the others,
+// so a slow or preempted core only delays the chunks it is running. Tasks
+// submitted from outside the pool go to a separate injection queue, which a
+// worker turns to only when no deque has anything for it.
+//
+// wait() may be called from inside a task: the waiting thread keeps running
+// queued tasks of the group it waits for, so nested parallel_for calls do not
+// deadlock the pool. It runs no other task, so the depth of nested tasks on a
+// stack follows the nesting of the calls, not the length of the queues.
+//
+// Workers are pinned by `pin` (BGR_PIN by default), numbered node by node, and
+// steal from the workers of their own node before going to another.
+class thread_pool
+{
+public:
+    explicit thread_pool(size_t threads = std::max(1U, std::thread::hardware_concurrency()), pin_policy pin = default_pin_policy())
+        : m_queues(threads), m_slots(numa_topology::instance().plan(pin, threads)), m_steal_order(threads)
+    {
+        for (auto&& queue : m_queues)
+            queue = std::make_unique<task_queue>();
+        for (size_t i{}; i < threads; ++i)
+        {
+            for (size_t j{ 1 }; j < threads; ++j)
+                m_steal_order[i].push_back((i + j) % threads);
+            std::stable_partition(m_steal_order[i].begin(), m_steal_order[i].end(),
+                [&](size_t j) { return m_slots[j].node == m_slots[i].node; });
+        }
+        for (size_t i{}; i < threads; ++i)
+            m_workers.emplace_back([this, i] { worker(i); });
+    }
+
+    thread_pool(const thread_pool&) = delete;
+    thread_pool& operator=(const thread_pool&) = delete;
+
+    ~thread_pool()
+    {
+        {
+            std::lock_guard _(m_sleep_mutex);
+            m_stop = true;
+        }
+        m_wake.notify_all();
+
+        for (auto&& worker : m_workers)
+            worker.join();
+    }
+
+    // Process-wide pool sized to the machine; threads are created once.
+    static thread_pool& instance()
+    {
+        static thread_pool pool;
+        return pool;
+    }
+
+    size_t size() const { return m_workers.size(); }
+    size_t worker_node(size_t index) const { return m_slots[index].node; }
+
+    void submit(task_group& group, std::function<void()> fn)
+    {
+        const auto self = current_index();
+        push(self != NO_WORKER ? *m_queues[self] : m_injected, group, std::move(fn));
+        notify(1);
+    }
+
+    void wait(task_group& group)
+    {
+        const auto self = current_index();
+        while (group.pending.load(std::memory_order_acquire))
+            if (!run_one(self, &group))
+                std::this_thread::yield();
+    }
+
+    // Calls fn(begin, end) on chunks of at most `grain` items covering
+    // [first, last). Chunks are dealt out in contiguous blocks, one block per
+    // worker deque, and idle workers steal what is left.
+    template <typename Fn>
+    void parallel_for(size_t first, size_t last, size_t grain, Fn&& fn)
+    {
+        if (first >= last)
+            return;
+
+        grain = std::max<size_t>(1, grain);
+        const auto chunks = (last - first + grain - 1) / grain;
+        const auto self = current_index();
+
+        task_group group;
+        for (size_t i{}; i < chunks; ++i)
+        {
+            const auto begin = first + i * grain;
+            const auto end = std::min(last, begin + grain);
+            const auto queue = self != NO_WORKER ? self : i * m_queues.size() / chunks;
+            push(*m_queues[queue], group, [&fn, begin, end] { fn(begin, end); });
+        }
+        notify(chunks);
+
+        wait(group);
+    }
+
+    // Calls fn(index, begin, end) on worker `index` for each of size()
+    // contiguous blocks of [first, last). A block is never stolen and the
+    // caller does not help, so block i always runs on worker i, e.g. on the
+    // node its memory was first touched from. Not for use inside a task of
+    // this pool.
+    template <typename Fn>
+    void for_each_worker(size_t first, size_t last, Fn&& fn)
+    {
+        const auto workers = m_queues.size();
+        task_group group;
+        for (size_t i{}; i < workers; ++i)
+        {
+            const auto begin = first + (last - first) * i / workers;
+            const auto end = first + (last - first) * (i + 1) / workers;
+            push(*m_queues[i], group, [&fn, i, begin, end] {
+                if (begin < end)
+                    fn(i, begin, end);
+                }, true);
+        }
+        notify(workers);
+
+        while (group.pending.load(std::memory_order_acquire))
+            std::this_thread::yield();
+    }
+
+private:
+    static constexpr auto NO_WORKER{ ~size_t{} };
+
+    struct task
+    {
+        std::function<void()> fn;
+        task_group* group;
+    };
+
+    struct alignas(64) task_queue
+    {
+        std::mutex m;
+        std::deque<task> tasks;
+        // Only this worker runs these, so they are not in m_queued.
+        std::deque<task> pinned;
+        std::atomic<size_t> pinned_count{};
+    };
+
+    size_t current_index() const
+    {
+        return t_pool == this ? t_index : NO_WORKER;
+    }
+
+    void push(task_queue& queue, task_group& group, std::function<void()> fn, bool pinned = false)
+    {
+        group.pending.fetch_add(1, std::memory_order_relaxed);
+        (pinned ? queue.pinned_count : m_queued).fetch_add(1, std::memory_order_release);
+
+        std::lock_guard _(queue.m);
+        (pinned ? queue.pinned : queue.tasks).push_back({ std::move(fn), &group });
+    }
+
+    void notify(size_t tasks)
+    {
+        {
+            std::lock_guard _(m_sleep_mutex);
+        }
+        if (tasks > 1)
+            m_wake.notify_all();
+        else
+            m_wake.notify_one();
+    }
+
+    // Takes the first task from the front, or the last from the back when
+    // stealing, that belongs to `only`, or to any group when it is null.
+    bool pop(task_queue& queue, bool steal, const task_group* only, task& out, bool pinned = false)
+    {
+        std::lock_guard _(queue.m);
+        auto& tasks = pinned ? queue.pinned : queue.tasks;
+        const auto matches = [only](const task& t) { return !only || t.group == only; };
+
+        auto it = tasks.end();
+        if (!steal)
+            it = std::find_if(tasks.begin(), tasks.end(), matches);
+        else if (const auto last = std::find_if(tasks.rbegin(), tasks.rend(), matches); last != tasks.rend())
+            it = std::prev(last.base());
+        if (it == tasks.end())
+            return false;
+
+        out = std::move(*it);
+        tasks.erase(it);
+        (pinned ? queue.pinned_count : m_queued).fetch_sub(1, std::memory_order_relaxed);
+        return true;
+    }
+
+    // Runs one task of `only`'s group, or of any group for an idle worker.
+    bool run_one(size_t self, const task_group* only = nullptr)
+    {
+        task t;
+        bool found = self != NO_WORKER && !only && pop(*m_queues[self], false, nullptr, t, true);
+        found = found || (self != NO_WORKER && pop(*m_queues[self], false, only, t));
+        if (self != NO_WORKER)
+            for (size_t i{}; !found && i < m_steal_order[self].size(); ++i)
+                found = pop(*m_queues[m_steal_order[self][i]], true, only, t);
+        else
+            for (size_t i{ 1 }; !found && i <= m_queues.size(); ++i)
+                found = pop(*m_queues[i % m_queues.size()], true, only, t);
+        // Never from inside a wait: a task started there would sit on the
+        // waiting task's stack, and so on, one image in batch per frame.
+        found = found || (!only && pop(m_injected, false, nullptr, t));
+        if (!found)
+            return false;
+
+        t.fn();
+        t.group->pending.fetch_sub(1, std::memory_order_acq_rel);
+        return true;
+    }
+
+    void worker(size_t index)
+    {
+        t_pool = this;
+        t_index = index;
+        pin_current_thread(m_slots[index].cpu);
+
+        for (;;)
+        {
+            if (run_one(index))
+                continue;
+
+            std::unique_lock lock(m_sleep_mutex);
+            m_wake.wait(lock, [this, index] {
+                return m_stop || m_queued.load(std::memory_order_acquire) || m_queues[index]->pinned_count.load(std::memory_order_acquire);
+                });
+            if (m_stop)
+                return;
+        }
+    }
+
+    static inline thread_local const thread_pool* t_pool{};
+    static inline thread_local size_t t_index{ NO_WORKER };
+
+    std::vector<std::unique_ptr<task_queue>> m_queues;
+    task_queue m_injected;
+    std::vector<numa_topology::slot> m_slots;
+    std::vector<std::vector<size_t>> m_steal_order;
+    std::vector<std::thread> m_workers;
+    std::atomic<size_t> m_queued{};
+    std::mutex m_sleep_mutex;
+    std::condition_variable m_wake;
+    bool m_stop{};
+};
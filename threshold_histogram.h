@@ -0,0 +1,97 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+#include "bmp.h"
+#include "reduce.h"
+#include "thread_pool.h"
+
+// Histogram of the b * g * r products, so the product < threshold count for
+// any threshold is a lookup instead of a rescan. A pixel matches iff its
+// product is in [0, threshold), so only non-negative products are kept.
+//
+// Products below HIST_EXACT_LIMIT, where thresholds normally live (and where
+// the SIMD kernel works), each have their own bin. Above it, up to the
+// largest product, bins are HIST_EXACT_LIMIT wide, so a threshold there is
+// exact only on a bin edge. Channels are signed, so the largest non-negative
+// product is (-128) * (-128) * 127, not 127^3.
+
+static constexpr uint32_t HIST_EXACT_LIMIT{ 1U << 16 };
+static constexpr uint32_t HIST_MAX_PRODUCT{ 128 * 128 * 127 };
+static constexpr size_t HIST_BINS{ HIST_EXACT_LIMIT + HIST_MAX_PRODUCT / HIST_EXACT_LIMIT };
+
+// Plugs into reduce_pixels with any_pixel.
+struct product_histogram_reduction
+{
+    std::vector<uint64_t> bins = std::vector<uint64_t>(HIST_BINS);
+
+    void add(const pixel& px)
+    {
+        const auto product = static_cast<int32_t>(px.b) * px.g * px.r;
+        if (product >= 0)
+            ++bins[product < static_cast<int32_t>(HIST_EXACT_LIMIT) ? product : HIST_EXACT_LIMIT - 1 + product / HIST_EXACT_LIMIT];
+    }
+
+    void merge(const product_histogram_reduction& other)
+    {
+        for (size_t i{}; i < HIST_BINS; ++i)
+            bins[i] += other.bins[i];
+    }
+};
+
+class threshold_histogram
+{
+public:
+    // Adds the pixels of `view` in one pass; several images can be added to
+    // answer for the whole set.
+    template <typename Policy = serial_policy>
+    void add(const pixel_view& view, const Policy& policy = {})
+    {
+        m_reduction.merge(reduce_pixels<any_pixel, product_histogram_reduction>(view, spread(policy, view)));
+        m_below.clear();
+    }
+
+    // Number of pixels with 0 <= product < threshold. Returns false, with the
+    // count below the nearest bin edge under `threshold`, when the threshold
+    // is not exact.
+    bool count_below(uint32_t threshold, uint64_t& cnt) const
+    {
+        if (m_below.empty())
+        {
+            m_below.assign(HIST_BINS + 1, 0);
+            for (size_t i{}; i < HIST_BINS; ++i)
+                m_below[i + 1] = m_below[i] + m_reduction.bins[i];
+        }
+
+        if (threshold <= HIST_EXACT_LIMIT)
+        {
+            cnt = m_below[threshold];
+            return true;
+        }
+        if (threshold > HIST_MAX_PRODUCT)
+        {
+            cnt = m_below[HIST_BINS];
+            return true;
+        }
+        cnt = m_below[HIST_EXACT_LIMIT - 1 + threshold / HIST_EXACT_LIMIT];
+        return threshold % HIST_EXACT_LIMIT == 0;
+    }
+
+private:
+    // Every chunk merges a full histogram, so hand each thread only a few
+    // large chunks instead of the default small ones.
+    static const serial_policy& spread(const serial_policy& policy, const pixel_view&) { return policy; }
+    static const openmp_policy& spread(const openmp_policy& policy, const pixel_view&) { return policy; }
+
+    static thread_policy spread(thread_policy policy, const pixel_view& view)
+    {
+        const auto threads = (policy.pool ? *policy.pool : thread_pool::instance()).size();
+        policy.chunk_size = std::max(policy.chunk_size, view.height * view.stride / (threads * 4) + 1);
+        return policy;
+    }
+
+    product_histogram_reduction m_reduction;
+    mutable std::vector<uint64_t> m_below;
+};
@@ -0,0 +1,460 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "bmp.h"
+#include "kernel.h"
+#include "thread_pool.h"
+
+// count_incremental() counts an image tile by tile, reusing the count of every
+// tile whose content has been counted before, in this run or an earlier one
+// whose cache was saved. An image that changed in a small region since its
+// last count only has the tiles covering that region recounted.
+//
+// Tiles are keyed by a hash of their pixels and the threshold alone, not by
+// image or position, so identical tiles anywhere share one entry. Hashing
+// still reads every byte, so a fully cached count only wins where hashing
+// is cheaper than counting. With the SIMD kernel on an image read from
+// memory both are bound by the same reads, so tile_cache_mode::automatic
+// counts directly wherever tile_cache_pays() finds that the cache loses.
+
+static constexpr auto TILE_WIDTH{ 64U };
+static constexpr auto TILE_HEIGHT{ 64U };
+static constexpr auto TILE_CACHE_MAX_ENTRIES{ 1U << 20 };
+static constexpr auto DIRECT_CHUNK_SIZE{ 64U << 10 };
+
+namespace tile_detail
+{
+    inline uint64_t mix(uint64_t h)
+    {
+        h = (h ^ (h >> 32)) * 0xD6E8FEB86659FD93ULL;
+        h = (h ^ (h >> 32)) * 0xD6E8FEB86659FD93ULL;
+        return h ^ (h >> 32);
+    }
+
+    // One xxh64 round, used to fold the accumulators into the key.
+    inline uint64_t round(uint64_t lane, uint64_t word)
+    {
+        lane += word * 0xC2B2AE3D27D4EB4FULL;
+        lane = lane << 31 | lane >> 33;
+        return lane * 0x9E3779B185EBCA87ULL;
+    }
+
+    // The tile is hashed as xxh3 hashes long inputs: four 64-bit accumulators
+    // take a 32-byte stripe at a time, each stripe keyed by its position in
+    // a block of STRIPES_PER_BLOCK, and a scramble ends every block. A row
+    // ends in a stripe of its own, its tail zero-padded, and the accumulators
+    // carry on into the next row, so a tile is finalized once, not per row.
+    static constexpr size_t STRIPE_SIZE{ 32 };
+    static constexpr size_t STRIPES_PER_BLOCK{ 16 };
+    static constexpr uint64_t SCRAMBLE_PRIME{ 0x9E3779B1 };
+
+    // Stripe n of a block is keyed by words n to n + 3; the scramble by the
+    // four after the last of those.
+    struct hash_secret
+    {
+        alignas(32) uint64_t words[STRIPES_PER_BLOCK + 8]{};
+
+        constexpr hash_secret()
+        {
+            uint64_t x{ 0x2545F4914F6CDD1DULL };
+            for (auto& word : words)
+            {
+                uint64_t z = x += 0x9E3779B97F4A7C15ULL;
+                z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+                z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+                word = z ^ (z >> 31);
+            }
+        }
+    };
+
+    inline constexpr hash_secret SECRET{};
+    inline constexpr uint64_t INITIAL_ACC[4]{ 0x9E3779B185EBCA87ULL, 0xC2B2AE3D27D4EB4FULL, 0x165667B19E3779F9ULL, 0x85EBCA77C2B2AE63ULL };
+
+    inline uint64_t load(const char* p)
+    {
+        uint64_t word;
+        std::memcpy(&word, p, sizeof(word));
+        return word;
+    }
+
+    // Calls stripe(p, n) for every stripe of the tile and scramble() after
+    // every block, the same sequence whatever the implementation.
+    template <typename Stripe, typename Scramble>
+    inline void for_each_stripe(const pixel_view& tile, Stripe&& stripe, Scramble&& scramble)
+    {
+        size_t n{};
+        const auto next = [&] {
+            if (++n == STRIPES_PER_BLOCK)
+            {
+                scramble();
+                n = 0;
+            }
+        };
+
+        for (size_t y{}; y < tile.height; ++y)
+        {
+            const auto* row = tile.row(y);
+            size_t i{};
+            for (; i + STRIPE_SIZE <= tile.row_size(); i += STRIPE_SIZE)
+            {
+                stripe(row + i, n);
+                next();
+            }
+            if (i < tile.row_size())
+            {
+                char tail[STRIPE_SIZE]{};
+                std::memcpy(tail, row + i, tile.row_size() - i);
+                stripe(tail, n);
+                next();
+            }
+        }
+    }
+
+    inline void accumulate_scalar(const pixel_view& tile, uint64_t acc[4])
+    {
+        for_each_stripe(tile, [acc](const char* p, size_t n) {
+            for (size_t l{}; l < 4; ++l)
+            {
+                const auto word = load(p + l * 8);
+                const auto keyed = word ^ SECRET.words[n + l];
+                acc[l ^ 1] += word;
+                acc[l] += (keyed & 0xFFFFFFFF) * (keyed >> 32);
+            }
+            }, [acc] {
+                for (size_t l{}; l < 4; ++l)
+                    acc[l] = (acc[l] ^ acc[l] >> 47 ^ SECRET.words[STRIPES_PER_BLOCK + 4 + l]) * SCRAMBLE_PRIME;
+            });
+    }
+
+#ifdef KERNEL_X86
+    // The scalar loop four lanes at a time; the shuffle adds each word to its
+    // neighbour's accumulator, as acc[l ^ 1] does there. Written out rather
+    // than through for_each_stripe, since lambdas do not inherit the target.
+    __attribute__((target("avx2")))
+    inline void accumulate_avx2(const pixel_view& tile, uint64_t acc[4])
+    {
+        auto acc_vec = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(acc));
+        const auto prime = _mm256_set1_epi64x(SCRAMBLE_PRIME);
+        const auto scramble_key = _mm256_load_si256(reinterpret_cast<const __m256i*>(SECRET.words + STRIPES_PER_BLOCK + 4));
+
+        size_t n{};
+        char tail[STRIPE_SIZE]{};
+        for (size_t y{}; y < tile.height; ++y)
+        {
+            const auto* row = tile.row(y);
+            for (size_t i{}; i < tile.row_size(); i += STRIPE_SIZE)
+            {
+                const auto* p = row + i;
+                if (i + STRIPE_SIZE > tile.row_size())
+                {
+                    std::memset(tail, 0, sizeof(tail));
+                    std::memcpy(tail, p, tile.row_size() - i);
+                    p = tail;
+                }
+
+                const auto word = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+                const auto keyed = _mm256_xor_si256(word, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(SECRET.words + n)));
+                const auto product = _mm256_mul_epu32(keyed, _mm256_srli_epi64(keyed, 32));
+                const auto swapped = _mm256_shuffle_epi32(word, _MM_SHUFFLE(1, 0, 3, 2));
+                acc_vec = _mm256_add_epi64(acc_vec, _mm256_add_epi64(product, swapped));
+
+                if (++n == STRIPES_PER_BLOCK)
+                {
+                    const auto x = _mm256_xor_si256(_mm256_xor_si256(acc_vec, _mm256_srli_epi64(acc_vec, 47)), scramble_key);
+                    const auto high = _mm256_slli_epi64(_mm256_mul_epu32(_mm256_srli_epi64(x, 32), prime), 32);
+                    acc_vec = _mm256_add_epi64(_mm256_mul_epu32(x, prime), high);
+                    n = 0;
+                }
+            }
+        }
+
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(acc), acc_vec);
+    }
+#endif
+}
+
+// Only the pixel bytes of each row go into the hash, never the padding, and
+// the tile's size and the threshold seed it. Every level gives the same key,
+// so a saved cache is valid on any machine.
+inline uint64_t tile_hash(simd_level level, const pixel_view& tile, uint32_t threshold)
+{
+    uint64_t acc[4]{ tile_detail::INITIAL_ACC[0], tile_detail::INITIAL_ACC[1], tile_detail::INITIAL_ACC[2], tile_detail::INITIAL_ACC[3] };
+#ifdef KERNEL_X86
+    if (level == simd_level::avx2)
+        tile_detail::accumulate_avx2(tile, acc);
+    else
+#endif
+        tile_detail::accumulate_scalar(tile, acc);
+    (void)level;
+
+    auto h = tile_detail::mix(threshold ^ tile.width << 20 ^ tile.height << 40);
+    for (auto lane : acc)
+        h = tile_detail::round(h, lane);
+    return tile_detail::mix(h);
+}
+
+inline uint64_t tile_hash(const pixel_view& tile, uint32_t threshold)
+{
+    static const auto level = detect_simd_level();
+    return tile_hash(level, tile, threshold);
+}
+
+// Tile counts by key, persisted as a flat file of (key, count) pairs in host
+// byte order; a file from another layout is rejected by its magic.
+class tile_cache
+{
+public:
+    explicit tile_cache(size_t max_entries = TILE_CACHE_MAX_ENTRIES)
+        : m_max_entries(max_entries)
+    {
+    }
+
+    // A missing file, or one keyed by another version of the hash, is an
+    // empty cache; only a damaged one is an error.
+    bool load(const std::filesystem::path& path)
+    {
+        std::ifstream input(path, std::ios::in | std::ios::binary);
+        if (!input.is_open())
+            return true;
+
+        uint32_t header[2]{};
+        uint64_t entries{};
+        if (!input.read(reinterpret_cast<char*>(header), sizeof(header)) || header[0] != MAGIC)
+            return false;
+        if (header[1] != VERSION)
+            return true;
+        if (!input.read(reinterpret_cast<char*>(&entries), sizeof(entries)))
+            return false;
+
+        // The count is checked against the file before it sizes anything, so
+        // a damaged one is an error rather than a huge allocation.
+        std::error_code error;
+        const auto size = std::filesystem::file_size(path, error);
+        if (error || entries > (size - HEADER_SIZE) / ENTRY_SIZE)
+            return false;
+
+        m_entries.reserve(entries);
+        for (uint64_t i{}; i < entries; ++i)
+        {
+            uint64_t key{};
+            uint32_t count{};
+            if (!input.read(reinterpret_cast<char*>(&key), sizeof(key)) || !input.read(reinterpret_cast<char*>(&count), sizeof(count)))
+                return false;
+            m_entries[key] = { count, false };
+        }
+        return true;
+    }
+
+    // Entries not used since loading are dropped first when the cache is
+    // over its size.
+    bool save(const std::filesystem::path& path)
+    {
+        for (auto it = m_entries.begin(); m_entries.size() > m_max_entries && it != m_entries.end();)
+            it = it->second.used ? std::next(it) : m_entries.erase(it);
+
+        std::ofstream output(path, std::ios::out | std::ios::binary | std::ios::trunc);
+        const uint32_t header[2]{ MAGIC, VERSION };
+        const uint64_t entries = std::min<size_t>(m_entries.size(), m_max_entries);
+        output.write(reinterpret_cast<const char*>(header), sizeof(header));
+        output.write(reinterpret_cast<const char*>(&entries), sizeof(entries));
+
+        auto it = m_entries.begin();
+        for (uint64_t i{}; i < entries; ++i, ++it)
+        {
+            output.write(reinterpret_cast<const char*>(&it->first), sizeof(it->first));
+            output.write(reinterpret_cast<const char*>(&it->second.count), sizeof(it->second.count));
+        }
+        return static_cast<bool>(output);
+    }
+
+    bool find(uint64_t key, uint32_t& count)
+    {
+        const auto it = m_entries.find(key);
+        if (it == m_entries.end())
+            return false;
+
+        it->second.used = true;
+        count = it->second.count;
+        return true;
+    }
+
+    void insert(uint64_t key, uint32_t count) { m_entries[key] = { count, true }; }
+
+    size_t size() const { return m_entries.size(); }
+
+private:
+    static constexpr uint32_t MAGIC{ 0x54524742 }; // "BGRT"
+    // 2: keys from the xxh64-round hash; 3: from the striped, xxh3-style one.
+    static constexpr uint32_t VERSION{ 3 };
+    static constexpr uint64_t HEADER_SIZE{ 2 * sizeof(uint32_t) + sizeof(uint64_t) };
+    static constexpr uint64_t ENTRY_SIZE{ sizeof(uint64_t) + sizeof(uint32_t) };
+
+    struct entry
+    {
+        uint32_t count{};
+        bool used{};
+    };
+
+    size_t m_max_entries;
+    std::unordered_map<uint64_t, entry> m_entries;
+};
+
+struct tile_stats
+{
+    size_t tiles{};
+    size_t recounted{};
+    // Counted without the cache; tiles and recounted are then 0.
+    bool direct{};
+};
+
+enum class tile_cache_mode
+{
+    automatic, // the cache where tile_cache_pays(), else a direct count
+    always,
+    never,
+};
+
+inline const char* tile_cache_mode_name(tile_cache_mode mode)
+{
+    switch (mode)
+    {
+    case tile_cache_mode::always: return "always";
+    case tile_cache_mode::never: return "never";
+    default: return "auto";
+    }
+}
+
+inline bool parse_tile_cache_mode(const std::string& name, tile_cache_mode& mode)
+{
+    for (auto m : { tile_cache_mode::automatic, tile_cache_mode::always, tile_cache_mode::never })
+        if (name == tile_cache_mode_name(m))
+        {
+            mode = m;
+            return true;
+        }
+    return false;
+}
+
+// Whether an image whose tiles are all cached is counted faster through the
+// cache than directly, on this CPU: hashing and looking up every tile of a
+// small synthetic image against counting it, best of a few runs, measured
+// once per process. The image stays in cache, so this compares the compute
+// of the two paths; an image streamed from memory gains less.
+inline bool tile_cache_pays()
+{
+    static const auto pays = [] {
+        constexpr size_t width{ 16 * TILE_WIDTH }, height{ 4 * TILE_HEIGHT };
+        std::vector<char> data(bmp_row_stride(width) * height);
+        for (size_t i{}; i < data.size(); ++i)
+            data[i] = static_cast<char>(i * 131 ^ i >> 7);
+        const pixel_view view{ data.data(), width, height, bmp_row_stride(width) };
+
+        std::vector<pixel_view> tiles;
+        for (size_t y{}; y < height; y += TILE_HEIGHT)
+            for (size_t x{}; x < width; x += TILE_WIDTH)
+                tiles.push_back({ view.row(y) + x * 3, TILE_WIDTH, TILE_HEIGHT, view.stride });
+
+        tile_cache cache;
+        for (auto&& tile : tiles)
+            cache.insert(tile_hash(tile, 1000), static_cast<uint32_t>(count_product_below(tile, 1000)));
+
+        const auto best = [](auto&& run) {
+            auto fastest = std::chrono::steady_clock::duration::max();
+            for (int rep{}; rep < 5; ++rep)
+            {
+                const auto start = std::chrono::steady_clock::now();
+                run();
+                fastest = std::min(fastest, std::chrono::steady_clock::now() - start);
+            }
+            return fastest;
+        };
+
+        volatile uint64_t sink{};
+        const auto cached = best([&] {
+            uint64_t cnt{};
+            for (auto&& tile : tiles)
+            {
+                uint32_t count{};
+                cache.find(tile_hash(tile, 1000), count);
+                cnt += count;
+            }
+            sink = cnt;
+            });
+        const auto direct = best([&] { sink = count_product_below(view, 1000); });
+        return cached < direct;
+    }();
+    return pays;
+}
+
+// Hashes every tile on the pool, looks the hashes up, then counts only the
+// tiles that missed, on the pool again. The cache itself is only touched from
+// the calling thread. Where the cache cannot win, per `mode`, the image is
+// counted directly on the pool and the cache is left as it is.
+inline uint64_t count_incremental(const pixel_view& view, tile_cache& cache, uint32_t threshold = 1000,
+    thread_pool& pool = thread_pool::instance(), tile_stats* stats = nullptr, tile_cache_mode mode = tile_cache_mode::automatic)
+{
+    if (mode == tile_cache_mode::never || (mode == tile_cache_mode::automatic && !tile_cache_pays()))
+    {
+        std::atomic<uint64_t> cnt{};
+        const auto chunk_rows = std::max<size_t>(1, DIRECT_CHUNK_SIZE / std::max<size_t>(view.stride, 1));
+        pool.parallel_for(0, view.height, chunk_rows, [&view, &cnt, threshold](size_t first, size_t last) {
+            cnt.fetch_add(count_product_below(view.rows(first, last - first), threshold), std::memory_order_relaxed);
+            });
+
+        if (stats)
+            *stats = { 0, 0, true };
+        return cnt;
+    }
+
+    const auto tiles_x = (view.width + TILE_WIDTH - 1) / TILE_WIDTH;
+    const auto tiles_y = (view.height + TILE_HEIGHT - 1) / TILE_HEIGHT;
+    const auto tile = [&view, tiles_x](size_t i) {
+        const auto x = i % tiles_x * TILE_WIDTH;
+        const auto y = i / tiles_x * TILE_HEIGHT;
+        return pixel_view{ view.row(y) + x * 3, std::min<size_t>(TILE_WIDTH, view.width - x),
+            std::min<size_t>(TILE_HEIGHT, view.height - y), view.stride };
+    };
+
+    std::vector<uint64_t> keys(tiles_x * tiles_y);
+    pool.parallel_for(0, tiles_y, 1, [&](size_t first, size_t last) {
+        for (auto i = first * tiles_x; i < last * tiles_x; ++i)
+            keys[i] = tile_hash(tile(i), threshold);
+        });
+
+    uint64_t cnt{};
+    std::vector<size_t> misses;
+    for (size_t i{}; i < keys.size(); ++i)
+    {
+        uint32_t count;
+        if (cache.find(keys[i], count))
+            cnt += count;
+        else
+            misses.push_back(i);
+    }
+
+    std::vector<uint32_t> counts(misses.size());
+    pool.parallel_for(0, misses.size(), tiles_x, [&](size_t first, size_t last) {
+        for (auto i = first; i < last; ++i)
+            counts[i] = static_cast<uint32_t>(count_product_below(tile(misses[i]), threshold));
+        });
+
+    for (size_t i{}; i < misses.size(); ++i)
+    {
+        cache.insert(keys[misses[i]], counts[i]);
+        cnt += counts[i];
+    }
+
+    if (stats)
+        *stats = { keys.size(), misses.size() };
+    return cnt;
+}